@@ -3,7 +3,14 @@ python ../test/test_mem.py
 python ../test/test_protocol.py
 rm -f ../test/test_slab
 rm -f ../test/test_util
+rm -f ../test/test_hashtab
+rm -f ../test/test_sketch
+rm -f ../test/test_wheel
 gcc -std=c99 -pedantic -Wall -W -lm ../test/test_base.c ../test/test_slab.c ../src/slab.c -o ../test/test_slab -D LC_TEST -I ../src/ && ../test/test_slab
 gcc -std=c99 -pedantic -Wall -W -lm ../test/test_base.c ../test/test_util.c ../src/util.c -o ../test/test_util -D LC_TEST -I ../src/ && ../test/test_util
+gcc -std=c99 -pedantic -Wall -W ../test/test_base.c ../test/test_hashtab.c ../src/hashtab.c ../src/mem.c ../src/slab.c -o ../test/test_hashtab -D LC_TEST -I ../src/ -lm -lpthread && ../test/test_hashtab
+gcc -std=c99 -pedantic -Wall -W ../test/test_base.c ../test/test_hashtab.c ../src/hashtab.c ../src/mem.c ../src/slab.c -o ../test/test_hashtab -D LC_TEST -D HAVE_SWISSTAB -I ../src/ -lm -lpthread && ../test/test_hashtab
+gcc -std=c99 -pedantic -Wall -W ../test/test_base.c ../test/test_sketch.c ../src/sketch.c ../src/mem.c ../src/slab.c -o ../test/test_sketch -D LC_TEST -I ../src/ -lm -lpthread && ../test/test_sketch
+gcc -std=c99 -pedantic -Wall -W ../test/test_base.c ../test/test_wheel.c ../src/wheel.c -o ../test/test_wheel -D LC_TEST -I ../src/ && ../test/test_wheel
 echo "*** AUTOTESTS finished."
 sleep 10000
@@ -19,6 +19,10 @@ def main():
         params += "-s %s " % (testconf.unix_socket_path)
     params += "-m %s " % (testconf.mem_avail)
     params += "-l %s " % (testconf.fd_limit)
+    params += "-t %s " % (testconf.num_threads)
+    params += "-n %s " % (testconf.num_shards)
+    if testconf.admission:
+        params += "-a "
         
     cmd = pre_cmd + " ../src/lightcache" + " " + params
     print "Executing %s..." % (cmd)    
@@ -0,0 +1,472 @@
+/*
+*    Chained hash table engine, see hashtab.c
+*    Sumer Cip 2010
+*/
+
+// Resizing does not move any item: a table of the new size becomes the current
+// table and the buckets of the previous one are moved into it a few at a time
+// by the following operations. See _hrehash_step().
+static int _hresize(_htab *ht, int logsize)
+{
+    int i, size;
+    _hitem **table;
+
+    size = HSIZE(logsize);
+    table = (_hitem **)li_malloc(size * sizeof(_hitem *));
+    if (!table) {
+        return 0;
+    }
+    for(i=0; i<size; i++)
+        table[i] = NULL;
+
+    ht->_otable = ht->_table;
+    ht->orealsize = ht->realsize;
+    ht->omask = ht->mask;
+    ht->rehashidx = 0;
+    ht->compactidx = -1; // the migration drops the free items, too
+
+    ht->_table = table;
+    ht->logsize = logsize;
+    ht->realsize = size;
+    ht->mask = HMASK(ht->logsize);
+    return 1;
+}
+
+// relinks the items of an old bucket into the current table. Items are not
+// re-allocated, so _hitem pointers stay valid. Free items are dropped on the
+// way instead of being carried to the new table.
+static void _hmigrate(_htab *ht, int i)
+{
+    _hitem *p, *next;
+    unsigned int h;
+
+    p = ht->_otable[i];
+    while(p) {
+        next = p->next;
+        if (p->free) {
+            li_free(p);
+            ht->count--;
+            ht->freecount--;
+        } else {
+            h = p->hash & ht->mask; // kept, never re-hashed
+            p->next = ht->_table[h];
+            ht->_table[h] = p;
+        }
+        p = next;
+    }
+    ht->_otable[i] = NULL;
+}
+
+// migrates up to HREHASH_STEP non-empty buckets. Empty buckets are cheap but
+// are bounded, too, so a single operation never does a long scan.
+static void _hrehash_step(_htab *ht)
+{
+    int n, empty;
+
+    if (ht->rehashidx == -1) {
+        return;
+    }
+
+    n = HREHASH_STEP;
+    empty = HREHASH_STEP * 10;
+    while (n && ht->rehashidx < ht->orealsize) {
+        if (!ht->_otable[ht->rehashidx]) {
+            ht->rehashidx++;
+            if (--empty == 0) {
+                break;
+            }
+            continue;
+        }
+        _hmigrate(ht, ht->rehashidx++);
+        n--;
+    }
+
+    if (ht->rehashidx == ht->orealsize) {
+        li_free(ht->_otable);
+        ht->_otable = NULL;
+        ht->orealsize = 0;
+        ht->omask = 0;
+        ht->rehashidx = -1;
+    }
+}
+
+// unlinks the free items of a few buckets and returns their memory. Like the
+// rehash, empty buckets are bounded, too.
+static void _hcompact_step(_htab *ht)
+{
+    int n;
+    _hitem *p, **pp;
+
+    for(n=0; n<HREHASH_STEP*10 && ht->compactidx<ht->realsize; n++, ht->compactidx++) {
+        pp = &ht->_table[ht->compactidx];
+        while(*pp) {
+            p = *pp;
+            if (p->free) {
+                *pp = p->next;
+                li_free(p);
+                ht->count--;
+                ht->freecount--;
+            } else {
+                pp = &p->next;
+            }
+        }
+    }
+
+    if (ht->compactidx == ht->realsize) {
+        ht->compactidx = -1;
+    }
+}
+
+// the table is only reorganized by hget() and hset(), so freeing while
+// enumerating is safe. A mostly empty table is halved, otherwise free items
+// are compacted once they outnumber the live ones.
+static void _hstep(_htab *ht)
+{
+    if (ht->rehashidx != -1) {
+        _hrehash_step(ht);
+        return;
+    }
+    if (ht->compactidx != -1) {
+        _hcompact_step(ht);
+        return;
+    }
+    if ((ht->logsize > ht->minlogsize) &&
+            (hcount(ht) < ht->realsize * HLOADFACTOR / HSHRINK_RATIO)) {
+        _hresize(ht, ht->logsize-1);
+    } else if ((ht->freecount > HREHASH_STEP) && (ht->freecount > hcount(ht))) {
+        ht->compactidx = 0;
+    }
+}
+
+// the hashes are compared first, keys are only compared for a full match.
+#define _HKEYEQ(p, key, klen, hash) \
+    (((p)->hash == (hash)) && ((p)->klen == (klen)) && (memcmp((p)->key, (key), (klen)) == 0))
+
+static _hitem *_hfind(_hitem *p, char *key, int klen, uint64_t hash)
+{
+    while(p) {
+        if (!p->free) {
+            if (_HKEYEQ(p, key, klen, hash)) {
+                return p;
+            }
+        }
+        p = p->next;
+    }
+    return NULL;
+}
+
+_htab *htcreate(int logsize)
+{
+    int i;
+    _htab *ht;
+
+    ht = (_htab *)li_malloc(sizeof(_htab));
+    if (!ht)
+        return NULL;
+    ht->logsize = logsize;
+    ht->minlogsize = logsize;
+    ht->realsize = HSIZE(logsize);
+    ht->mask = HMASK(logsize);
+    ht->count = 0;
+    ht->freecount = 0;
+    ht->_otable = NULL;
+    ht->orealsize = 0;
+    ht->omask = 0;
+    ht->rehashidx = -1;
+    ht->compactidx = -1;
+    ht->_table = (_hitem **)li_malloc(ht->realsize * sizeof(_hitem *));
+    if (!ht->_table) {
+        li_free(ht);
+        return NULL;
+    }
+
+    for(i=0; i<ht->realsize; i++)
+        ht->_table[i] = NULL;
+
+    return ht;
+}
+
+static void _hfreetable(_hitem **table, int size)
+{
+    int i;
+    _hitem *p, *next;
+
+    for(i=0; i<size; i++) {
+        p = table[i];
+        while(p) {
+            next = p->next;
+            li_free(p);
+            p = next;
+        }
+    }
+    li_free(table);
+}
+
+// val should be freed with henum(...), because obviously we cannot know if it
+// contains other pointers, too.
+void htdestroy(_htab *ht)
+{
+    if (ht->_otable) {
+        _hfreetable(ht->_otable, ht->orealsize);
+    }
+    _hfreetable(ht->_table, ht->realsize);
+    li_free(ht);
+}
+
+
+hresult hset(_htab *ht, char* key, int klen, uint64_t hash, void *val)
+{
+    int i;
+    _hitem *new, *p, **buckets[2];
+
+    _hstep(ht);
+
+    buckets[0] = &ht->_table[hash & ht->mask];
+    buckets[1] = ht->_otable ? &ht->_otable[hash & ht->omask] : NULL;
+    new = NULL;
+    for(i=0; i<2 && buckets[i]; i++) {
+        p = *buckets[i];
+        while(p) {
+            if ( (!p->free) && _HKEYEQ(p, key, klen, hash)) {
+                return HEXISTS;
+            }
+            if (p->free)
+                new = p;
+            p = p->next;
+        }
+    }
+    // have a free slot?
+    if (new) {
+        new->key = key;
+        new->klen = klen;
+        new->hash = hash;
+        new->val = val;
+        new->free = 0;
+        ht->freecount--;
+    } else {
+        new = (_hitem *)li_malloc(sizeof(_hitem));
+        if (!new) {
+            return HERROR;
+        }
+        new->key = key;
+        new->klen = klen;
+        new->hash = hash;
+        new->val = val;
+        new->next = *buckets[0]; // add to front
+        new->free = 0;
+        *buckets[0] = new;
+        ht->count++;
+    }
+    // need resizing? The item is already added, so a failed grow is not an
+    // error for the caller; the table is only more loaded until the next try.
+    if ((ht->rehashidx == -1) &&
+            (((ht->count - ht->freecount) / (double)ht->realsize) >= HLOADFACTOR)) {
+        _hresize(ht, ht->logsize+1);
+    }
+    return HSUCCESS;
+}
+
+_hitem *hget(_htab *ht, char *key, int klen, uint64_t hash)
+{
+    _hitem *p;
+
+    _hstep(ht);
+
+    p = _hfind(ht->_table[hash & ht->mask], key, klen, hash);
+    if (!p && ht->_otable) {
+        p = _hfind(ht->_otable[hash & ht->omask], key, klen, hash);
+    }
+    return p;
+}
+
+static _hitem *_hfindval(_hitem *p, uint64_t hash, void *val)
+{
+    while(p) {
+        if (!p->free && (p->hash == hash) && (p->val == val)) {
+            return p;
+        }
+        p = p->next;
+    }
+    return NULL;
+}
+
+_hitem *hgetval(_htab *ht, uint64_t hash, void *val)
+{
+    _hitem *p;
+
+    p = _hfindval(ht->_table[hash & ht->mask], hash, val);
+    if (!p && ht->_otable) {
+        p = _hfindval(ht->_otable[hash & ht->omask], hash, val);
+    }
+    return p;
+}
+
+static int _henumtable(_hitem **table, int size, int (*enumfn)(_hitem *item, void *arg),
+                       void *arg, int enum_free)
+{
+    int rc, i;
+    _hitem *p, *next;
+
+    for(i=0; i<size; i++) {
+        p = table[i];
+        while(p) {
+            next = p->next;
+            if ((!p->free) || (enum_free)) {
+                rc = enumfn(p, arg); // item may be freed.
+                if(rc)
+                    return rc;
+            }
+            p = next;
+        }
+    }
+    return 0;
+}
+
+// enums non-free items
+void henum(_htab *ht, int (*enumfn)(_hitem *item, void *arg), void *arg, int enum_free)
+{
+    if (ht->_otable) {
+        if (_henumtable(ht->_otable, ht->orealsize, enumfn, arg, enum_free)) {
+            return;
+        }
+    }
+    _henumtable(ht->_table, ht->realsize, enumfn, arg, enum_free);
+}
+
+int hcount(_htab *ht)
+{
+    return (ht->count - ht->freecount);
+}
+
+void hfree(_htab *ht, _hitem *item)
+{
+    if (!item->free) {
+        item->free = 1;
+        ht->freecount++;
+    }
+}
+
+#ifdef LC_TEST
+static int count_item_enum(_hitem *item, void *arg)
+{
+    if (item) {
+        (*(int *)arg)++;
+    }
+    return 0;
+}
+
+void test_hashtab(void)
+{
+    int i, n;
+    char key[32];
+    static char keys[20000][16]; // the table does not copy the keys
+    _htab *ht;
+    _hitem *it, *first;
+
+    ht = htcreate(2);
+    assert(ht != NULL);
+
+    assert(hset(ht, "key0", 4, hhash("key0", 4), (void *)1) == HSUCCESS);
+    first = hget(ht, "key0", 4, hhash("key0", 4));
+    assert(first != NULL);
+
+    // grow many times, every item must be reachable in the middle of a rehash.
+    for(i=1; i<20000; i++) {
+        n = sprintf(keys[i], "key%d", i);
+        assert(hset(ht, keys[i], n, hhash(keys[i], n), (void *)(long)(i+1)) == HSUCCESS);
+        assert(hset(ht, keys[i], n, hhash(keys[i], n), NULL) == HEXISTS);
+        if (ht->rehashidx != -1) {
+            n = sprintf(key, "key%d", i/2);
+            it = hget(ht, key, n, hhash(key, n));
+            assert(it != NULL);
+            assert(it->val == (void *)(long)(i/2+1));
+        }
+    }
+    assert(hcount(ht) == 20000);
+    assert(ht->logsize > 2);
+
+    // items are relinked, not re-allocated while rehashing.
+    assert(hget(ht, "key0", 4, hhash("key0", 4)) == first);
+
+    // free items are reused or dropped by the migration.
+    for(i=0; i<20000; i+=2) {
+        n = sprintf(key, "key%d", i);
+        it = hget(ht, key, n, hhash(key, n));
+        assert(it != NULL);
+        hfree(ht, it);
+        assert(hget(ht, key, n, hhash(key, n)) == NULL);
+    }
+    assert(hcount(ht) == 10000);
+
+    n = 0;
+    henum(ht, count_item_enum, &n, 0);
+    assert(n == 10000);
+
+    // the rehash completes with lookups only.
+    for(i=0; i<HSIZE(ht->logsize) && ht->rehashidx != -1; i++) {
+        hget(ht, "key1", 4, hhash("key1", 4));
+    }
+    assert(ht->rehashidx == -1);
+    assert(ht->_otable == NULL);
+    for(i=1; i<20000; i+=2) {
+        n = sprintf(key, "key%d", i);
+        assert(hget(ht, key, n, hhash(key, n)) != NULL);
+    }
+
+    // a mostly empty table shrinks, the free items are dropped on the way.
+    n = ht->logsize;
+    for(i=201; i<20000; i+=2) {
+        it = hget(ht, keys[i], strlen(keys[i]), hhash(keys[i], strlen(keys[i])));
+        assert(it != NULL);
+        hfree(ht, it);
+    }
+    for(i=0; i<100000; i++) {
+        hget(ht, "key1", 4, hhash("key1", 4));
+    }
+    assert(ht->logsize < n);
+    assert(ht->logsize > 2);
+    assert(ht->rehashidx == -1);
+    assert(ht->freecount <= hcount(ht));
+    assert(hcount(ht) == 100);
+    for(i=1; i<200; i+=2) {
+        n = sprintf(key, "key%d", i);
+        assert(hget(ht, key, n, hhash(key, n)) != NULL);
+    }
+
+    // equal hashes do not make equal keys.
+    assert(hset(ht, "coll1", 5, 42, (void *)1) == HSUCCESS);
+    assert(hset(ht, "coll2", 5, 42, (void *)2) == HSUCCESS);
+    assert(hget(ht, "coll1", 5, 42)->val == (void *)1);
+    assert(hget(ht, "coll2", 5, 42)->val == (void *)2);
+    assert(hgetval(ht, 42, (void *)2) == hget(ht, "coll2", 5, 42));
+    assert(hgetval(ht, 42, (void *)3) == NULL);
+    assert(hgetval(ht, 43, (void *)2) == NULL);
+
+    htdestroy(ht);
+
+    // free items are compacted once they outnumber the live ones.
+    ht = htcreate(10);
+    assert(ht != NULL);
+    for(i=0; i<700; i++) {
+        n = strlen(keys[i+1]);
+        assert(hset(ht, keys[i+1], n, hhash(keys[i+1], n), NULL) == HSUCCESS);
+    }
+    for(i=0; i<500; i++) {
+        n = strlen(keys[i+1]);
+        hfree(ht, hget(ht, keys[i+1], n, hhash(keys[i+1], n)));
+    }
+    assert(hcount(ht) == 200);
+    for(i=0; i<1000; i++) {
+        hget(ht, "key1", 4, hhash("key1", 4));
+    }
+    assert(ht->logsize == 10);
+    assert(ht->compactidx == -1);
+    assert(ht->freecount <= hcount(ht));
+    assert(ht->count < 400);
+    for(i=500; i<700; i++) {
+        n = strlen(keys[i+1]);
+        assert(hget(ht, keys[i+1], n, hhash(keys[i+1], n)) != NULL);
+    }
+    htdestroy(ht);
+}
+#endif
@@ -3,14 +3,14 @@
 #include "util.h"
 
 /* globals */
-static int epollfd = 0;
-static void (*event_handler)(conn *c, event ev) = NULL;
-static struct epoll_event events[POLL_MAX_EVENTS];
+static LC_THREAD int epollfd = 0;
+static LC_THREAD void (*event_handler)(conn *c, event ev) = NULL;
+static LC_THREAD struct epoll_event events[POLL_MAX_EVENTS];
 
 /* constants */
 
 /* functions */
-int event_init(void (*ev_handler)(conn *c, event ev))
+int event_init(void (*ev_handler)(conn *c, event ev), void (*tm_handler)(conn *c))
 {
     epollfd = epoll_create(POLL_MAX_EVENTS);
     if (epollfd == -1) {        
@@ -19,6 +19,7 @@ int event_init(void (*ev_handler)(conn *c, event ev))
         return 0;
     }
     event_handler = ev_handler;
+    timer_init(tm_handler);
     return  epollfd;
 }
 
@@ -64,13 +65,24 @@ int event_set(conn *c, int flags)
     return 1;
 }
 
-void event_process(void)
+int event_accept(conn *c)
+{
+    return accept(c->fd, NULL, NULL);
+}
+
+ssize_t event_read(conn *c, void *buf, size_t count)
+{
+    return read(c->fd, buf, count);
+}
+
+void event_process(int timeout)
 {
     int nfds, n;
     conn *conn;
 
 
-    nfds = epoll_wait(epollfd, events, POLL_MAX_EVENTS, POLL_TIMEOUT);
+    nfds = epoll_wait(epollfd, events, POLL_MAX_EVENTS, timer_timeout(timeout));
+    update_time();
     if (nfds == -1) {        
         LC_DEBUG(("epoll_wait error.[%s]\r\n", strerror(errno)));
         syslog(LOG_ERR, "%s (%s)", "epoll wait error.", strerror(errno));
@@ -90,6 +102,8 @@ void event_process(void)
         }
 
     }
+
+    timer_process();
 }
 
 
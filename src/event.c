@@ -1,6 +1,58 @@
+#ifdef HAVE_IO_URING
+#define _GNU_SOURCE /* syscall() */
+#endif
+
 #include "event_config.h"
 #include "event.h"
+#include "wheel.h"
+#include "util.h"
+
+/* Connection timers of the worker. Handlers re-arm them as they need, so
+ * only the timers that expire are visited. */
+static LC_THREAD wheel timers;
+static LC_THREAD void (*timer_handler)(conn *c) = NULL;
+
+static void timer_init(void (*tm_handler)(conn *c))
+{
+    wheel_init(&timers, CURRENT_TIME_MS, EVENT_TIMER_RESOLUTION);
+    timer_handler = tm_handler;
+}
+
+// the wait for events ends when the next timer can expire. The time of the
+// previous cycle is used, the wait may only end as late as that cycle took.
+static int timer_timeout(int timeout)
+{
+    if (timeout <= 0) {
+        return timeout;
+    }
+    return (int)wheel_next(&timers, CURRENT_TIME_MS, (unsigned int)timeout);
+}
+
+static void expire_timer(wheel_node *node, void *arg)
+{
+    (void)arg;
+    timer_handler((conn *)((char *)node - offsetof(conn, timer)));
+}
 
+static void timer_process(void)
+{
+    wheel_expire(&timers, CURRENT_TIME_MS, EVENT_TIMER_BUDGET, expire_timer, NULL);
+}
+
+void event_timer_set(conn *c, uint64_t expiry)
+{
+    wheel_del(&c->timer);
+    wheel_add(&timers, &c->timer, expiry);
+}
+
+void event_timer_del(conn *c)
+{
+    wheel_del(&c->timer);
+}
+
+#ifdef HAVE_IO_URING
+#include "uring.c"
+#else
 #ifdef HAVE_EPOLL
 #include "epoll.c"
 #else
@@ -10,4 +62,4 @@
 #include "select.c"
 #endif
 #endif
-
+#endif
@@ -4,15 +4,20 @@
 #ifndef EVENT_H
 #define EVENT_H
 
-#define POLL_TIMEOUT 1000 // in ms todo: maybe get it from settings?
+#define POLL_TIMEOUT 1000 // in ms, the longest wait of the loop for events and timers
 #define POLL_MAX_EVENTS 10
+#define EVENT_TIMER_RESOLUTION 10 /* msecs per tick of the timer wheel */
+#define EVENT_TIMER_BUDGET 1024 /* expired timers handled per event_process() */
 
 typedef enum {
     EVENT_READ = 0x01,
     EVENT_WRITE = 0x02,
 } event;
 
-int event_init(void (*ev_handler)(conn *c, event ev));
+/* tm_handler is called for connections whose timer expired, they are out of
+ * the timer wheel by then.
+*/
+int event_init(void (*ev_handler)(conn *c, event ev), void (*tm_handler)(conn *c));
 
 /* Deletes all previous events and set the new flags.
 */
@@ -22,8 +27,28 @@ int event_set(conn *c, int flags);
 */
 int event_del(conn *c);
 
-/* Call in server loop
+/* Arms the timer of the connection to expire at the given msecs, moving it
+ * if it was already armed.
+*/
+void event_timer_set(conn *c, uint64_t expiry);
+
+/* Disarms the timer of the connection, if armed.
+*/
+void event_timer_del(conn *c);
+
+/* Takes a connection of a listening conn whose READ event is being handled,
+ * like accept().
+*/
+int event_accept(conn *c);
+
+/* Reads the received bytes of a conn whose READ event is being handled, like
+ * read().
+*/
+ssize_t event_read(conn *c, void *buf, size_t count);
+
+/* Call in server loop. Waits at most timeout msecs for events, less if a timer
+ * is due sooner, and handles the events and then the expired timers.
 */
-void event_process(void);
+void event_process(int timeout);
 
 #endif
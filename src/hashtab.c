@@ -5,217 +5,140 @@
 #include "hashtab.h"
 #include "mem.h"
 
-// one_at_a_time hashing
-// This is similar to the rotating hash, but it actually mixes the internal state. It takes
-// 9n+9 instructions and produces a full 4-byte result. Preliminary analysis suggests there are
-// no funnels. This hash was not in the original Dr. Dobb's article. I implemented it to fill
-// a set of requirements posed by Colin Plumb. Colin ended up using an even simpler (and weaker)
-// hash that was sufficient for his purpose.
-static int HHASH(_htab *ht, char *key, int len)
+static uint64_t hash_seed = 0;
+
+// wyhash (Wang Yi, public domain). Keys are read 4 and 8 bytes at a time,
+// and the random seed keeps crafted keys from colliding on purpose.
+static const uint64_t _wyp[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                                 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+static void _wymum(uint64_t *a, uint64_t *b)
 {
-    int   hash, i;
-    for (hash=0, i=0; i<len; ++i) {
-        hash += key[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return (hash & ht->mask);
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 u128;
+    u128 r;
+
+    r = (u128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha, hb, la, lb, rh, rm0, rm1, rl, t, c, lo;
+
+    ha = *a >> 32; hb = *b >> 32; la = (uint32_t)*a; lb = (uint32_t)*b;
+    rh = ha * hb; rm0 = ha * lb; rm1 = hb * la; rl = la * lb;
+    t = rl + (rm0 << 32);
+    c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
 }
 
-static int _hgrow(_htab *ht)
+static uint64_t _wymix(uint64_t a, uint64_t b)
 {
-    int i;
-    _htab *dummy;
-    _hitem *p, *next, *it;
-
-    fprintf(stderr, "hgrow called growing to:%d", ht->logsize+1);
-
-    dummy = htcreate(ht->logsize+1);
-    if (!dummy) {
-        return 0;
-    }
-    for(i=0; i<ht->realsize; i++) {
-        p = ht->_table[i];
-        while(p) {
-            next = p->next;
-            if (hset(dummy, p->key, p->klen, p->val) != HSUCCESS) {
-                return 0;
-            }
-            it = hget(dummy, p->key, p->klen);
-            if (!it) {
-                return 0;
-            }
-            it->free = p->free;
-            li_free(p->key);
-            li_free(p);
-            p = next;
-        }
-    }
-
-    li_free(ht->_table);
-    ht->_table = dummy->_table;
-    ht->logsize = dummy->logsize;
-    ht->realsize = dummy->realsize;
-    ht->mask = dummy->mask;
-    li_free(dummy);
-    return 1;
+    _wymum(&a, &b);
+    return a ^ b;
 }
 
-_htab *htcreate(int logsize)
+static uint64_t _wyr8(const uint8_t *p)
 {
-    int i;
-    _htab *ht;
-
-    ht = (_htab *)li_malloc(sizeof(_htab));
-    if (!ht)
-        return NULL;
-    ht->logsize = logsize;
-    ht->realsize = HSIZE(logsize);
-    ht->mask = HMASK(logsize);
-    ht->count = 0;
-    ht->freecount = 0;
-    ht->_table = (_hitem **)li_malloc(ht->realsize * sizeof(_hitem *));
-    if (!ht->_table) {
-        li_free(ht);
-        return NULL;
-    }
-
-    for(i=0; i<ht->realsize; i++)
-        ht->_table[i] = NULL;
-
-    return ht;
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
 }
 
-// val should be freed with henum(...), because obviously we cannot know if it
-// contains other pointers, too.
-void htdestroy(_htab *ht)
+static uint64_t _wyr4(const uint8_t *p)
 {
-    int i;
-    _hitem *p, *next;
-
-    for(i=0; i<ht->realsize; i++) {
-        p = ht->_table[i];
-        while(p) {
-            next = p->next;
-            li_free(p->key); // we also create keys.
-            li_free(p);
-            p = next;
-        }
-    }
-
-    li_free(ht->_table);
-    li_free(ht);
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
 }
 
+void hseed(uint64_t seed)
+{
+    hash_seed = seed;
+}
 
-hresult hset(_htab *ht, char* key, int klen, void *val)
+uint64_t hhash(char *key, int klen)
 {
-    unsigned int h;
-    _hitem *new, *p;
-
-    h = HHASH(ht, key, klen);
-    p = ht->_table[h];
-    new = NULL;
-    while(p) {
-        if ( (strcmp(p->key, key)==0) && (!p->free)) {
-            return HEXISTS;
-        }
-        if (p->free)
-            new = p;
-        p = p->next;
-    }
-    // have a free slot?
-    if (new) {
-        // do we need new allocation for the key?
-        if (new->klen < klen+1) {
-            li_free(new->key); // free previous
-            new->key = (char*)li_malloc(klen+1);
-            if (!new->key) {
-                return HERROR;
-            }
+    const uint8_t *p;
+    uint64_t a, b, seed, see1, see2;
+    size_t len, i;
+
+    p = (const uint8_t *)key;
+    len = (size_t)klen;
+    seed = hash_seed ^ _wymix(hash_seed ^ _wyp[0], _wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_wyr4(p) << 32) | _wyr4(p + ((len >> 3) << 2));
+            b = (_wyr4(p + len - 4) << 32) | _wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
         }
-        memcpy(new->key, key, klen+1); // copy the last "0" byte
-        new->klen = klen;
-        new->val = val;
-        new->free = 0;
-        ht->freecount--;
     } else {
-        new = (_hitem *)li_malloc(sizeof(_hitem));
-        if (!new) {
-            return HERROR;
-        }
-        new->key = (char*)li_malloc(klen+1);
-        if (!new->key) {
-            li_free(new);
-            return HERROR;
-        }
-        memcpy(new->key, key, klen+1);
-        new->klen = klen;
-        new->val = val;
-        new->next = ht->_table[h]; // add to front
-        new->free = 0;
-        ht->_table[h] = new;
-        ht->count++;
-    }
-    // need resizing?
-    if (((ht->count - ht->freecount) / (double)ht->realsize) >= HLOADFACTOR) {
-        if (!_hgrow(ht)) {
-            return HERROR;
+        i = len;
+        if (i > 48) {
+            see1 = see2 = seed;
+            do {
+                seed = _wymix(_wyr8(p) ^ _wyp[1], _wyr8(p + 8) ^ seed);
+                see1 = _wymix(_wyr8(p + 16) ^ _wyp[2], _wyr8(p + 24) ^ see1);
+                see2 = _wymix(_wyr8(p + 32) ^ _wyp[3], _wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
         }
-    }
-    return HSUCCESS;
-}
-
-_hitem *hget(_htab *ht, char *key, int klen)
-{
-    _hitem *p;
-
-    p = ht->_table[HHASH(ht, key, klen)];
-    while(p) {
-        if (!p->free) {
-            if (strcmp(p->key, key)==0) {
-                return p;
-            }
+        while (i > 16) {
+            seed = _wymix(_wyr8(p) ^ _wyp[1], _wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
         }
-        p = p->next;
+        a = _wyr8(p + i - 16);
+        b = _wyr8(p + i - 8);
     }
-    return NULL;
+    a ^= _wyp[1];
+    b ^= seed;
+    _wymum(&a, &b);
+    return _wymix(a ^ _wyp[0] ^ len, b ^ _wyp[1]);
 }
 
-// enums non-free items
-void henum(_htab *ht, int (*enumfn)(_hitem *item, void *arg), void *arg, int enum_free)
+#ifdef LC_TEST
+void test_hhash(void)
 {
-    int rc, i;
-    _hitem *p, *next;
-
-    for(i=0; i<ht->realsize; i++) {
-        p = ht->_table[i];
-        while(p) {
-            next = p->next;
-            if ((!p->free) || (enum_free)) {
-                rc = enumfn(p, arg); // item may be freed.
-                if(rc)
-                    return;
-            }
-            p = next;
+    char key[64];
+    int i;
+    uint64_t h;
+
+    memset(key, 'a', sizeof(key));
+
+    // every length takes a different read path, all bytes must count.
+    for(i=0; i<(int)sizeof(key); i++) {
+        h = hhash(key, i);
+        assert(h == hhash(key, i));
+        assert(h != hhash(key, i+1));
+        key[i] = 'b';
+        if (i) {
+            assert(hhash(key, i) != hhash(key, i+1));
         }
+        key[i] = 'a';
     }
-}
 
-int hcount(_htab *ht)
-{
-    return (ht->count - ht->freecount);
+    // the seed changes all hashes.
+    h = hhash("key", 3);
+    hseed(0x1234);
+    assert(h != hhash("key", 3));
+    hseed(0);
+    assert(h == hhash("key", 3));
 }
-
-void hfree(_htab *ht, _hitem *item)
-{
-    if (!item->free) {
-        item->free = 1;
-        ht->freecount++;
-    }
-}
-
-
+#endif
+
+// the table engine is selected at compile time, see Makefile.
+#ifdef HAVE_SWISSTAB
+#include "swisstab.c"
+#else
+#include "chaintab.c"
+#endif
@@ -4,15 +4,23 @@
 *
 * 	 v0.2 -- fix & optimization on hset()
 *    v0.3 -- demand_mem() function for hashtable
+*    v0.4 -- incremental rehashing, growth no longer re-inserts all items at once
+*    v0.5 -- open addressing engine, built with HAVE_SWISSTAB
+*    v0.6 -- seeded 64-bit hash, computed once by the caller and kept per item
+*    v0.7 -- keys are not copied, they belong to the caller's item
+*    v0.8 -- free items are compacted and mostly empty tables shrink
 */
 
 #ifndef HASHTAB_H
 #define HASHTAB_H
 
-#define HSIZE(n) (1<<n)
+#include "stdint.h"
+
+#define HSIZE(n) (1<<(n))
 #define HMASK(n) (HSIZE(n)-1)
 #define SWAP(a, b) (((a) ^= (b)), ((b) ^= (a)), ((a) ^= (b)))
-#define HLOADFACTOR 0.75
+#define HREHASH_STEP 4 // buckets (groups) migrated per operation while rehashing
+#define HSHRINK_RATIO 4 // tables loaded below HLOADFACTOR/HSHRINK_RATIO are halved
 
 typedef enum {
     HSUCCESS = 0x01,
@@ -20,9 +28,48 @@ typedef enum {
     HEXISTS = 0x03, // item already exists while adding
 } hresult;
 
+#ifdef HAVE_SWISSTAB
+
+#define HLOADFACTOR 0.875
+#define HDELETED_ROOM 0.0625 // slots above the load factor for deleted ones, when the table cannot grow
+#define HGROUP_SIZE 16 // control bytes compared at once
+
+// Items are stored inline in the slot array, so an _hitem pointer is only
+// valid until the next hget()/hset() call on the table.
 struct _hitem {
     char* key;
     int klen;
+    uint64_t hash;
+    void *val;
+};
+typedef struct _hitem _hitem;
+
+typedef struct {
+    signed char *ctrl; // per slot: 7 bits of the hash if full, or empty/deleted
+    _hitem *slots;
+    int realsize;      // a multiple of HGROUP_SIZE
+    int mask;          // group index mask
+    int count;         // full slots
+    int deleted;       // deleted slots, reclaimed by the next resize
+} _hslots;
+
+typedef struct {
+    int logsize;
+    int minlogsize;    // the initial size, tables do not shrink below it
+    _hslots t;         // current slots
+    _hslots old;       // previous slots, migrated into t while rehashing
+    int rehashidx;     // next group of old to migrate, -1 if not rehashing
+    int capped;        // the slots could not be resized, see hset()
+} _htab;
+
+#else
+
+#define HLOADFACTOR 0.75
+
+struct _hitem {
+    char* key;
+    int klen;
+    uint64_t hash;
     void *val;
     int free; // for recycling.
     struct _hitem *next;
@@ -36,14 +83,37 @@ typedef struct {
     int mask;
     int freecount;
     _hitem ** _table;
+    _hitem ** _otable; // previous table, migrated into _table while rehashing
+    int orealsize;
+    int omask;
+    int rehashidx; // next bucket of _otable to migrate, -1 if not rehashing
+    int compactidx; // next bucket of _table to drop free items from, -1 if not compacting
+    int minlogsize; // the initial size, tables do not shrink below it
 } _htab;
 
+#endif
+
+/* keys are looked up with their hhash() value, which the caller computes once
+ * per key. hseed() must be called before any table is used. hset() does not
+ * copy the key: it must stay valid until the item is freed, or its key is
+ * pointed to another copy. */
+void hseed(uint64_t seed);
+uint64_t hhash(char *key, int klen);
+
 _htab *htcreate(int logsize);
 void htdestroy(_htab *ht);
-_hitem *hget(_htab *ht, char *key, int klen);
-hresult hset(_htab *ht, char *key, int klen, void *val);
+_hitem *hget(_htab *ht, char *key, int klen, uint64_t hash);
+/* the item of hash that holds val. Keys are not compared, for a caller that
+ * cannot read the key safely; the table is not reorganized. */
+_hitem *hgetval(_htab *ht, uint64_t hash, void *val);
+hresult hset(_htab *ht, char *key, int klen, uint64_t hash, void *val);
 void henum(_htab *ht, int (*fn) (_hitem *item, void *arg), void *arg, int enum_free);
 int hcount(_htab *ht);
 void hfree(_htab *ht, _hitem *item);
 
+#ifdef LC_TEST
+void test_hhash(void);
+void test_hashtab(void);
+#endif
+
 #endif
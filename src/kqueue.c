@@ -2,16 +2,16 @@
 #include "sys/types.h"
 #include "sys/event.h"
 #include "sys/time.h"
+#include "util.h"
 
 /* globals */
-static int kqfd = 0;
-static void (*event_handler)(conn *c, event ev) = NULL;
-static struct timespec timeout;
+static LC_THREAD int kqfd = 0;
+static LC_THREAD void (*event_handler)(conn *c, event ev) = NULL;
 
 /* constants */
 
 /* functions */
-int event_init(void (*ev_handler)(conn *c, event ev))
+int event_init(void (*ev_handler)(conn *c, event ev), void (*tm_handler)(conn *c))
 {
     kqfd = kqueue();
     if (kqfd == -1) {
@@ -19,10 +19,7 @@ int event_init(void (*ev_handler)(conn *c, event ev))
         return 0;
     }
     event_handler = ev_handler;
-
-    /* calculate timeout */
-    timeout.tv_sec = POLL_TIMEOUT / 1000; /* TODO: convert ms to sec/nsec */
-    timeout.tv_nsec = 0;
+    timer_init(tm_handler);
 
     return  kqfd;
 }
@@ -68,13 +65,28 @@ err:
     return 0;
 }
 
-void event_process(void)
+int event_accept(conn *c)
+{
+    return accept(c->fd, NULL, NULL);
+}
+
+ssize_t event_read(conn *c, void *buf, size_t count)
+{
+    return read(c->fd, buf, count);
+}
+
+void event_process(int timeout)
 {
     int nfds, n;
     struct kevent events[POLL_MAX_EVENTS];
+    struct timespec ts;
     conn *conn;
 
-    nfds = kevent(kqfd, NULL, 0, events, POLL_MAX_EVENTS, &timeout);
+    timeout = timer_timeout(timeout);
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    nfds = kevent(kqfd, NULL, 0, events, POLL_MAX_EVENTS, &ts);
+    update_time();
     if (nfds == -1) {
         syslog(LOG_ERR, "%s (%s)", "kqueue wait error.", strerror(errno));
         return;
@@ -93,6 +105,8 @@ void event_process(void)
             event_handler(conn, EVENT_WRITE);
         }
     }
+
+    timer_process();
 }
 
 
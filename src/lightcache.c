@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* SO_REUSEPORT, CPU affinity */
+
 #include "lightcache.h"
 #include "protocol.h"
 #include "socket.h"
@@ -6,18 +8,40 @@
 #include "mem.h"
 #include "util.h"
 #include "slab.h"
+#include "shard.h"
 #include "sys/resource.h"
+#include "sys/uio.h"
+#include "pthread.h"
 
 /* forward declarations */
 void set_conn_state(struct conn* conn, conn_states state);
+int try_send_response(conn *conn);
 
 /* exported globals */
 struct settings settings;
-struct stats stats;
+LC_THREAD struct stats stats;
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    int listen_fd;
+    int node; /* NUMA node the worker runs on, -1 if not pinned */
+    struct stats *stats; /* points to the thread-local stats of the worker */
+} worker;
 
 /* module globals */
-static conn *conns = NULL; /* linked list head */
-static _htab *cache = NULL;
+static LC_THREAD conn *conns = NULL; /* connections in use, per worker */
+static LC_THREAD conn *free_conns = NULL; /* stack of released conn records */
+static LC_THREAD unsigned int nfree_conns = 0;
+static LC_THREAD int numa_node = -1; /* node of the calling worker */
+static uint64_t idle_epoch = 0; /* bumped when idle_conn_timeout is lowered */
+static LC_THREAD uint64_t idle_epoch_seen = 0; /* see rearm_conns() */
+static int numa_simulated = 0; /* nodes are given with -N, memory is not bound to them */
+static worker workers[LIGHTCACHE_MAX_THREADS];
+static size_t shard_arena_size = 0; /* in MB, 0 if shards use the default allocator */
+static int ready_workers = 0;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
 
 // initialize defaults for settings
 void init_settings(void)
@@ -33,6 +57,11 @@ void init_settings(void)
     settings.socket_path = NULL;    // unix domain socket is off by default.
     settings.use_sys_malloc = 0;
     settings.fd_limit = 1024; // rlimit_nofile -- requires root
+    settings.num_threads = 1;
+    settings.num_shards = 1;
+    settings.admission = 0;
+    settings.slab_automove = 1;
+    settings.numa_nodes = 0; // detected
 }
 
 void init_log(void)
@@ -51,134 +80,512 @@ void init_stats(void)
     stats.get_misses = 0;
     stats.bytes_read = 0;
     stats.bytes_written = 0;
+    stats.alloc_local = 0;
+    stats.alloc_remote = 0;
+    stats.conn_memory = 0;
+    stats.conn_buffers = 0;
 }
 
-struct conn* make_conn(int fd) {
-    struct conn *conn, *item;
+/* Sums the stats of all workers. Counters of the other workers are loaded
+ * one by one while they change, so the result is a close approximation under
+ * load. */
+static void sum_stats(struct stats *total)
+{
+    int i;
+    struct stats *ws;
+
+    memset(total, 0, sizeof(struct stats));
+    total->start_time = stats.start_time;
+    for(i=0; i<settings.num_threads; i++) {
+        ws = __atomic_load_n(&workers[i].stats, __ATOMIC_ACQUIRE);
+        if (!ws) {
+            continue;
+        }
+        total->curr_connections += STATS_LOAD(ws, curr_connections);
+        total->cmd_get += STATS_LOAD(ws, cmd_get);
+        total->cmd_set += STATS_LOAD(ws, cmd_set);
+        total->get_hits += STATS_LOAD(ws, get_hits);
+        total->get_misses += STATS_LOAD(ws, get_misses);
+        total->bytes_read += STATS_LOAD(ws, bytes_read);
+        total->bytes_written += STATS_LOAD(ws, bytes_written);
+        total->alloc_local += STATS_LOAD(ws, alloc_local);
+        total->alloc_remote += STATS_LOAD(ws, alloc_remote);
+        total->conn_memory += STATS_LOAD(ws, conn_memory);
+        total->conn_buffers += STATS_LOAD(ws, conn_buffers);
+    }
+}
+
+/* Appends the chunk usage of the slab classes, summed over the arenas, at buf.
+ * frag is the share of the free chunks, frag_before the share when the class
+ * was compacted last. Returns the end of the text. */
+static char *class_stats(char *buf)
+{
+    int i, cls, n;
+    uint64_t used, free, cfree, ctotal, slabs, compacted, relocated;
+    unsigned int chunk_size;
+    slab_class_stats_t cs;
+    shard *sh;
+
+    n = shard_get(0)->arena ? shard_count() : 1;
+    for(cls=0; cls<LIGHTCACHE_LRU_CLASSES; cls++) {
+        used = free = cfree = ctotal = slabs = compacted = relocated = 0;
+        chunk_size = 0;
+        for(i=0; i<n; i++) {
+            sh = shard_get(i);
+            if (!shard_class_stats(sh, cls, &cs)) {
+                continue;
+            }
+            chunk_size = cs.chunk_size;
+            slabs += cs.slabs;
+            used += cs.chunks_used;
+            free += cs.chunks_free;
+            pthread_mutex_lock(&sh->lock);
+            cfree += sh->compaction[cls].free;
+            ctotal += sh->compaction[cls].total;
+            compacted += sh->compaction[cls].slabs;
+            relocated += sh->compaction[cls].relocated;
+            pthread_mutex_unlock(&sh->lock);
+        }
+        if (!slabs && !compacted) {
+            continue;
+        }
+        buf += sprintf(buf,
+                "class%d:chunk_size=%u,slabs=%llu,used=%llu,frag=%llu%%,frag_before=%llu%%,"
+                "slabs_compacted=%llu,relocated=%llu\r\n",
+                cls,
+                chunk_size,
+                (long long unsigned int)slabs,
+                (long long unsigned int)used,
+                (long long unsigned int)(slabs ? free * 100 / (used + free) : 0),
+                (long long unsigned int)(ctotal ? cfree * 100 / ctotal : 0),
+                (long long unsigned int)compacted,
+                (long long unsigned int)relocated);
+    }
+    return buf;
+}
 
-    conn = NULL;
-    // search for free items first
-    for(item=conns; item!=NULL ; item=item->next) {
-        if (item->free) {
-            conn = item;
+/* Appends the allocations counted per size, summed over the arenas, and the
+ * chunk sizes that would waste the least memory for them, as many as there
+ * are classes for these sizes. size_waste is the memory wasted by the current
+ * classes, size_waste_layout the one of slab_layout, both estimated with the
+ * upper bound of the sizes. slab_layout is applied with -c at a restart.
+ * Returns the end of the text. */
+static char *size_stats(char *buf)
+{
+    int i, n, cls, ncls;
+    unsigned int b, j, k, count, size, sizes[SLAB_MAX_LAYOUT], chunks[LIGHTCACHE_LRU_CLASSES];
+    uint64_t hist[SLAB_HIST_BUCKETS], waste, lwaste;
+    slab_class_stats_t cs;
+
+    // chunk sizes of the classes, the same in every arena.
+    count = 0;
+    for(ncls=0; ncls<LIGHTCACHE_LRU_CLASSES; ncls++) {
+        if (!shard_class_stats(shard_get(0), ncls, &cs)) {
             break;
         }
+        chunks[ncls] = cs.chunk_size;
+        if ((cs.chunk_size <= SLAB_HIST_MAX) && (count < SLAB_MAX_LAYOUT)) {
+            count++;
+        }
     }
+    if (!ncls) {
+        return buf;
+    }
+    memset(hist, 0, sizeof(hist));
+    n = shard_get(0)->arena ? shard_count() : 1;
+    for(i=0; i<n; i++) {
+        shard_size_hist(shard_get(i), hist);
+    }
+
+    k = slab_layout(hist, count, sizes);
+    waste = lwaste = 0;
+    cls = 0;
+    j = 0;
+    for(b=0; b<SLAB_HIST_BUCKETS; b++) {
+        if (!hist[b]) {
+            continue;
+        }
+        size = (b + 1) * CHUNK_ALIGN_BYTES;
+        buf += sprintf(buf, "size%u:%llu\r\n", size, (long long unsigned int)hist[b]);
+        while ((cls < ncls-1) && (chunks[cls] < size)) {
+            cls++;
+        }
+        if (chunks[cls] >= size) {
+            waste += hist[b] * (chunks[cls] - size);
+        }
+        while (k && (j < k-1) && (sizes[j] < size)) {
+            j++;
+        }
+        if (k && (sizes[j] >= size)) {
+            lwaste += hist[b] * (sizes[j] - size);
+        }
+    }
+    buf += sprintf(buf, "size_waste:%llu\r\nsize_waste_layout:%llu\r\nslab_layout:",
+            (long long unsigned int)waste, (long long unsigned int)lwaste);
+    for(j=0; j<k; j++) {
+        buf += sprintf(buf, j ? ",%u" : "%u", sizes[j]);
+    }
+    return buf + sprintf(buf, "\r\n");
+}
+
+/* Takes a released conn record from the free stack, or allocates one, and
+ * links it to the connections in use. Both are O(1). */
+struct conn* make_conn(int fd) {
+    struct conn *conn;
 
-    // no free item?
-    if (conn == NULL) {
+    if (free_conns) {
+        conn = free_conns;
+        free_conns = conn->next;
+        nfree_conns--;
+    } else {
         conn = (struct conn*)li_malloc(sizeof(struct conn));
         if (!conn) {
             return NULL;
         }
-        conn->next = conns;
-        conns = conn;
+        conn->bufs = NULL;
+        conn->timer.prev = NULL;
+        STATS_ADD(conn_memory, sizeof(struct conn));
+    }
+    conn->prev = NULL;
+    conn->next = conns;
+    if (conns) {
+        conns->prev = conn;
     }
+    conns = conn;
 
     conn->fd = fd;
-    conn->last_heard = CURRENT_TIME;
+    conn->last_heard = CURRENT_TIME_MS;
     conn->listening = 0;
     conn->free = 0;
     conn->in = NULL;
+    conn->out = NULL;
+    conn->rbuf = NULL;
+    conn->rlen = 0;
+    conn->rcurr = 0;
+    conn->nout = 0;
+    conn->sbytes = 0;
+    conn->events = 0;
 
-    stats.curr_connections++;
+    STATS_ADD(curr_connections, 1);
 
     return conn;
 }
 
-// NOTE: htab key is re-used so we do not free it. 
-static void del_cached_req(_hitem *it)
+static void free_item(item *it)
 {
-    request *req;
-        
-    req = ((request *)it->val);
-    if (req) {
-        li_free(req->rkey);
-        li_free(req->rdata);
-        li_free(req->rextra);
-        li_free(req);
+    shard_free(shard_of(it->hash), it);
+}
+
+// The htab key points into the item, so the table entry must be freed or
+// re-pointed, too. The item itself is freed once no queued response is
+// sending its value anymore. The shard lock is held.
+static void unlink_item(shard *sh, _hitem *tab_item)
+{
+    item *it;
+
+    it = (item *)tab_item->val;
+    if (it) {
+        shard_lru_unlink(sh, it);
+        wheel_del(&it->timer);
+        if (it->gen != sh->gen) {
+            sh->stale--;
+        }
+        if (it->refcount) {
+            it->flags |= ITEM_UNLINKED;
+        } else {
+            free_item(it);
+        }
     }
-    it->val = NULL;
+    tab_item->val = NULL;
 }
 
-static void free_request(conn *conn)
+// evicts the least recently used item of an LRU list. The shard lock is held.
+static int evict_item(shard *sh, int cls)
 {
-    request *req;
+    item *it;
+    _hitem *tab_item;
+    uint64_t now;
 
-    req = conn->in;
-    if ((!req) || (!req->can_free)) {
-        return;
+    it = shard_lru_tail(sh, cls);
+    if (!it) {
+        return 0;
+    }
+    tab_item = hget(sh->cache, ITEM_KEY(it), it->klen, it->hash);
+    assert(tab_item != NULL);
+    assert(tab_item->val == it);
+
+    now = CURRENT_TIME_MS;
+    if (it->timer.expiry < now) { // expired and flushed ones are not counted
+        if (!(it->flags & ITEM_FETCHED)) {
+            sh->stats.expired_unfetched++;
+        }
+    } else if (it->gen == shard_gen(sh, now)) {
+        sh->stats.evictions++;
     }
+    unlink_item(sh, tab_item);
+    hfree(sh->cache, tab_item);
 
-    li_free(req->rkey);
-    li_free(req->rdata);
-    li_free(req->rextra);
-    li_free(req);
-    conn->in = NULL;
+    return 1;
+}
+
+// TinyLFU: a new key only replaces the eviction victim if it was accessed more
+// often recently. Updates of cached keys are always admitted, otherwise the
+// old value would stay. The shard lock is held.
+static int admit_item(shard *sh, int cls, request *req)
+{
+    item *victim;
+    uint64_t now;
+
+    now = CURRENT_TIME_MS;
+    victim = shard_lru_tail(sh, cls);
+    if (!victim || (victim->timer.expiry < now) || (victim->gen != shard_gen(sh, now))) {
+        return 1;
+    }
+    if (hget(sh->cache, req->rkey, req->req_header.request.key_length, req->hash)) {
+        return 1;
+    }
+    if (sketch_estimate(sh->sketch, req->hash) < sketch_estimate(sh->sketch, victim->hash)) {
+        sh->stats.rejected++;
+        return 0;
+    }
+    sh->stats.admitted++;
+    return 1;
+}
+
+// allocates the item of a request, when the shard is out of memory the least
+// recently used items of the same class are evicted to make room for it. On
+// failure req->drop tells why.
+static item *alloc_item(request *req, size_t size)
+{
+    item *it;
+    shard *sh;
+    int cls, tries;
+
+    sh = req->shard;
+    cls = shard_class(sh, size);
+    it = NULL;
+    if (shard_has_room(sh, size)) {
+        it = (item *)shard_malloc(sh, size);
+    }
+    if (!it) {
+        pthread_mutex_lock(&sh->lock);
+        if (sh->sketch && ((req->req_header.request.opcode == CMD_SET) ||
+                           (req->req_header.request.opcode == CMD_SET_MS))) {
+            if (!admit_item(sh, cls, req)) {
+                pthread_mutex_unlock(&sh->lock);
+                req->drop = DROP_REJECTED;
+                return NULL;
+            }
+        }
+        sh->starved[cls]++;
+        for(tries=0; tries<LIGHTCACHE_EVICT_TRIES && evict_item(sh, cls); tries++) {
+            if (shard_has_room(sh, size)) {
+                it = (item *)shard_malloc(sh, size);
+                if (it) {
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+        if (!it) { // nothing left to evict, the reserve is used
+            it = (item *)shard_malloc(sh, size);
+        }
+        if (!it) {
+            req->drop = DROP_NOMEM;
+            return NULL;
+        }
+    }
+    // the header is read by drains of the slab on other workers, see chunk_item().
+    __atomic_store_n(&it->cls, cls, __ATOMIC_RELAXED);
+    it->prev = it->next = NULL;
+    if (sh->arena && (sh->node >= 0)) {
+        if (sh->node == numa_node) {
+            STATS_ADD(alloc_local, 1);
+        } else {
+            STATS_ADD(alloc_remote, 1);
+        }
+    }
+
+    return it;
+}
+
+static void release_item(item *it)
+{
+    shard *sh;
+
+    sh = shard_of(it->hash);
+    pthread_mutex_lock(&sh->lock);
+    assert(it->refcount > 0);
+    if ((--it->refcount == 0) && (it->flags & ITEM_UNLINKED)) {
+        free_item(it);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void free_request(conn *conn)
+{
+    if (conn->in && conn->in->item) { // not given to the cache
+        free_item(conn->in->item);
+        conn->in->item = NULL;
+    }
 }
 
-static void free_response(conn *conn)
+static void free_responses(conn *conn)
 {
+    unsigned int i;
     response *resp;
-    
-    resp = &conn->out;
-    if (resp->can_free) {
-        li_free(resp->sdata);
+
+    for(i=0; i<conn->nout; i++) {
+        resp = &conn->out[i];
+        if (resp->item) {
+            release_item(resp->item);
+            resp->item = NULL;
+        } else if (resp->can_free) {
+            free(resp->sdata);
+        }
+        resp->sdata = NULL;
     }
-    resp->sdata = NULL;
+    conn->nout = 0;
+    conn->sbytes = 0;
 }
 
 
-static int init_resources(conn *conn)
-{         
-    free_request(conn);
-    free_response(conn);
-             
-    conn->in = (request *)li_malloc(sizeof(request));
+/* Prepares the request for the next one. A connection without buffers has
+ * nothing to prepare, alloc_buffers() does it when bytes arrive. */
+static void init_request(conn *conn)
+{
     if (!conn->in) {
+        return;
+    }
+    free_request(conn);
+
+    conn->in->rbytes = 0;
+    conn->in->rkey[0] = (char)0;
+    conn->in->rextra[0] = (char)0;
+    conn->in->item = NULL;
+    conn->in->drop = 0;
+    conn->in->hash = 0;
+    conn->in->shard = shard_get(0); // requests without a key
+}
+
+static uint64_t idle_deadline(conn *conn, uint64_t secs)
+{
+    if (secs >= (UINT64_MAX - conn->last_heard) / 1000) {
+        return UINT64_MAX;
+    }
+    return conn->last_heard + secs * 1000;
+}
+
+/* The next time an idle connection needs attention: its buffers are released
+ * first, then it is disconnected. */
+static uint64_t conn_deadline(conn *conn)
+{
+    uint64_t deadline;
+
+    deadline = idle_deadline(conn, SETTING_LOAD(idle_conn_timeout));
+    if (conn->bufs && deadline > idle_deadline(conn, LIGHTCACHE_CONN_RELEASE_TIME)) {
+        deadline = idle_deadline(conn, LIGHTCACHE_CONN_RELEASE_TIME);
+    }
+    return deadline;
+}
+
+static int alloc_buffers(conn *conn)
+{
+    conn->bufs = (conn_buffers *)li_malloc(sizeof(conn_buffers));
+    if (!conn->bufs) {
         return 0;
     }
-  
-    conn->in->rbytes = 0;    
-    conn->in->rkey = NULL;
-    conn->in->rdata = NULL;
-    conn->in->rextra = NULL;    
-    conn->in->can_free = 1;  
-
-    conn->out.sdata = NULL;
-    conn->out.sbytes = 0;
-    conn->out.can_free = 1;
-   
+    conn->in = &conn->bufs->in;
+    conn->out = conn->bufs->out;
+    conn->rbuf = conn->bufs->rbuf;
+    conn->in->item = NULL;
+    init_request(conn);
+    STATS_ADD(conn_memory, sizeof(conn_buffers));
+    STATS_ADD(conn_buffers, 1);
+
+    // the timer was armed for the idle timeout, it is due sooner now.
+    if (conn->timer.expiry > conn_deadline(conn)) {
+        event_timer_set(conn, conn_deadline(conn));
+    }
+
     return 1;
 }
 
+static void free_buffers(conn *conn)
+{
+    if (!conn->bufs) {
+        return;
+    }
+    li_free(conn->bufs);
+    conn->bufs = NULL;
+    conn->in = NULL;
+    conn->out = NULL;
+    conn->rbuf = NULL;
+    conn->rlen = conn->rcurr = 0;
+    STATS_SUB(conn_memory, sizeof(conn_buffers));
+    STATS_SUB(conn_buffers, 1);
+}
+
+/* An idle connection releases its buffers when nothing of a request is
+ * buffered or being parsed and no response is waiting. */
+static void release_buffers(conn *conn)
+{
+    if (conn->bufs && (conn->state == READ_HEADER) && !conn->in->rbytes &&
+            (conn->rcurr == conn->rlen) && !conn->nout) {
+        free_buffers(conn);
+    }
+}
+
 static void disconnect_conn(conn* conn)
 {
     LC_DEBUG(("disconnect conn called.\r\n"));
 
     free_request(conn);
-    free_response(conn);
-
+    free_responses(conn);
+    free_buffers(conn);
+    event_timer_del(conn);
+
+    // the record goes to the free stack. It is not freed here, events of
+    // this cycle may still refer to it, see event_handler().
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    conn->next = free_conns;
+    free_conns = conn;
+    nfree_conns++;
     conn->free = 1;
 
     event_del(conn);
     close(conn->fd);
 
-    stats.curr_connections--;
+    STATS_SUB(curr_connections, 1);
 
     set_conn_state(conn, CONN_CLOSED);
 }
 
-static void add_response(conn *conn, void *data, size_t data_length, code_t code)
+/* Queues a response for the current request. Queued responses are written
+ * together by try_send_response(). */
+static response *add_response(conn *conn, void *data, size_t data_length, code_t code)
 {
-    conn->out.resp_header.response.data_length = htonl(data_length);
-    conn->out.resp_header.response.opcode = conn->in->req_header.request.opcode;
-    conn->out.resp_header.response.retcode = code;
+    response *resp;
+
+    assert(conn->nout < LIGHTCACHE_OUTPUT_QUEUE_SIZE);
+
+    resp = &conn->out[conn->nout++];
+    resp->resp_header.response.data_length = htonl(data_length);
+    resp->resp_header.response.opcode = conn->in->req_header.request.opcode;
+    resp->resp_header.response.retcode = code;
     
-    conn->out.sdata = data;
-    conn->out.can_free = 1;
+    resp->sdata = data;
+    resp->can_free = 1;
+    resp->item = NULL;
 
-    set_conn_state(conn, SEND_HEADER);    
+    return resp;
 } 
 
 static void send_response(conn *conn, code_t code)
@@ -189,47 +596,40 @@ static void send_response(conn *conn, code_t code)
 
 void set_conn_state(struct conn* conn, conn_states state)
 {
+    item *it;
+
     switch(state) {
     case READ_HEADER:
-        if (!init_resources(conn)) {
-            LC_DEBUG(("req/resp resources cannot be initialized.\r\n"));
-            disconnect_conn(conn); // we cannot receive anything.
-            return;
-        }
-        event_set(conn, EVENT_READ);
+        init_request(conn);
         break;
     case READ_KEY:
-        conn->in->rkey = (char *)li_malloc(conn->in->req_header.request.key_length + 1);
-        if (!conn->in->rkey) {
-            send_response(conn, OUT_OF_MEMORY);
-            return;
-        }
         conn->in->rkey[conn->in->req_header.request.key_length] = (char)0;
         break;
     case READ_DATA:
-        conn->in->rdata = (char *)li_malloc(conn->in->req_header.request.data_length + 1);
-        if (!conn->in->rdata) {
-            send_response(conn, OUT_OF_MEMORY);
-            return;
+        // one chunk for the item, the value is read into it directly. A value
+        // without an item is skipped, execute_cmd() replies according to drop.
+        it = alloc_item(conn->in, ITEM_SIZE(conn->in->req_header.request.key_length,
+                        conn->in->req_header.request.data_length));
+        if (!it) {
+            break;
         }
-        conn->in->rdata[conn->in->req_header.request.data_length] = (char)0;
+        it->timer.prev = it->timer.next = NULL;
+        it->timer.expiry = 0;
+        __atomic_store_n(&it->hash, conn->in->hash, __ATOMIC_RELAXED);
+        it->refcount = 0;
+        it->dlen = conn->in->req_header.request.data_length;
+        it->gen = 0;
+        __atomic_store_n(&it->klen, conn->in->req_header.request.key_length, __ATOMIC_RELAXED);
+        it->flags = 0;
+        memcpy(ITEM_KEY(it), conn->in->rkey, it->klen + 1);
+        ITEM_DATA(it)[it->dlen] = (char)0;
+        conn->in->item = it;
         break;
     case READ_EXTRA:
-        conn->in->rextra = (char *)li_malloc(conn->in->req_header.request.extra_length + 1);
-        if (!conn->in->rextra) {
-            send_response(conn, OUT_OF_MEMORY);
-            return;
-        }
         conn->in->rextra[conn->in->req_header.request.extra_length] = (char)0;
         break;
     case CMD_RECEIVED:
         break;
-    case CMD_SENT:
-        break;
-    case SEND_HEADER:
-        conn->out.sbytes = 0;
-        event_set(conn, EVENT_WRITE);
-        break;
     default:
         break;
     }
@@ -238,37 +638,53 @@ void set_conn_state(struct conn* conn, conn_states state)
 
 }
 
-static int flush_item_enum(_hitem *item, void *arg)
+/* TTL of a set request in msecs. CMD_SET sends the secs as a string and
+ * CMD_SET_MS sends the msecs as a network ordered integer. */
+static int parse_ttl(request *req, uint8_t cmd, uint64_t *ttl)
 {
-    if (arg) {
-        ;   // suppress unused param. warning.
+    uint64_t val;
+
+    if (cmd == CMD_SET_MS) {
+        if (req->req_header.request.extra_length != sizeof(uint64_t)) {
+            return 0;
+        }
+        memcpy(&val, req->rextra, sizeof(uint64_t));
+        *ttl = ntohll(val);
+        return (*ttl != 0);
     }
-    
-    LC_DEBUG(("flush_item called.\r\n"));
-    
-    del_cached_req(item);
-    hfree(cache, item);
 
-    return 0;
+    if (!atoull(req->rextra, &val)) {
+        return 0;
+    }
+    *ttl = (val > UINT64_MAX / 1000) ? UINT64_MAX : val * 1000;
+    return 1;
 }
 
-
 static void execute_cmd(struct conn* conn)
 {
-    int r;
     hresult ret;
     uint8_t cmd;
-    uint64_t val;
-    request *cached_req;
+    uint64_t val, old;
+    item *it;
     _hitem *tab_item;
-    char *sval;
+    char *sval, *p;
     uint64_t *ival;
+    int i, items, slen;
+    uint64_t mem_used, mem_committed, evictions, admitted, rejected, reclaimed, expired_unfetched, stale, moved;
+    struct stats tstats;
+    shard *sh;
 
     assert(conn->state == CMD_RECEIVED);
 
     /* here, the complete request is received from the connection */
-    conn->in->received = CURRENT_TIME;
+    conn->in->received = CURRENT_TIME_MS;
     cmd = conn->in->req_header.request.opcode;
+    sh = conn->in->shard;
+
+    if (conn->in->drop == DROP_NOMEM) {
+        send_response(conn, OUT_OF_MEMORY);
+        return;
+    }
     
     /* No need for the validation of conn->in->rkey as it is mandatory for the
        protocol. */
@@ -277,63 +693,108 @@ static void execute_cmd(struct conn* conn)
 
         LC_DEBUG(("CMD_GET [%s]\r\n", conn->in->rkey));
 
-        stats.cmd_get++;
+        STATS_ADD(cmd_get, 1);
+
+        pthread_mutex_lock(&sh->lock);
+        sh->stats.cmd_get++;
+        if (sh->sketch) { // misses count, too: the key may be set next
+            sketch_add(sh->sketch, conn->in->hash);
+        }
 
         /* get item */
-        tab_item = hget(cache, conn->in->rkey, conn->in->req_header.request.key_length);
+        tab_item = hget(sh->cache, conn->in->rkey, conn->in->req_header.request.key_length, conn->in->hash);
         if (!tab_item) {
+            sh->stats.get_misses++;
+            pthread_mutex_unlock(&sh->lock);
             LC_DEBUG(("Key not found:%s\r\n", conn->in->rkey));
             goto GET_KEY_NOTEXISTS;
         }
-        cached_req = (request *)tab_item->val;
-
-        /* check timeout expire */
-        r = atoull(cached_req->rextra, &val);
-        assert(r != 0);/* CMD_SET already does this validation but re-check*/
-
-        if ((unsigned int)(conn->in->received-cached_req->received) > val) {
-            LC_DEBUG(("Time expired for key:%s\r\n", conn->in->rkey));
-            del_cached_req(tab_item);
-            hfree(cache, tab_item);
+        it = (item *)tab_item->val;
+
+        /* check timeout expire and flushes */
+        if ((conn->in->received > it->timer.expiry) ||
+                (it->gen != shard_gen(sh, conn->in->received))) {
+            LC_DEBUG(("Time expired or flushed for key:%s\r\n", conn->in->rkey));
+            unlink_item(sh, tab_item);
+            hfree(sh->cache, tab_item);
+            sh->stats.get_misses++;
+            pthread_mutex_unlock(&sh->lock);
             goto GET_KEY_NOTEXISTS;
         }
 
-        stats.get_hits++;
+        // the value is sent from the cache, it is kept alive until the
+        // response is written.
+        it->refcount++;
+        it->flags |= ITEM_FETCHED;
+        shard_lru_bump(sh, it);
+        sh->stats.get_hits++;
+        pthread_mutex_unlock(&sh->lock);
 
-        add_response(conn, cached_req->rdata, cached_req->req_header.request.data_length, SUCCESS);
-        conn->out.can_free = 0;
+        STATS_ADD(get_hits, 1);
+
+        add_response(conn, ITEM_DATA(it), it->dlen, SUCCESS)->item = it;
         break;
     case CMD_SET:
+    case CMD_SET_MS:
 
         LC_DEBUG(("CMD_SET \r\n"));
 
-        stats.cmd_set++;
+        STATS_ADD(cmd_set, 1);
+
+        if (conn->in->drop == DROP_REJECTED) {
+            // not cached, as if it was evicted right away.
+            send_response(conn, SUCCESS);
+            return;
+        }
 
         // validate params
-        if (!conn->in->rdata) {
+        it = conn->in->item;
+        if (!it) {
             LC_DEBUG(("Invalid data param in CMD_SET\r\n"));
             send_response(conn, INVALID_PARAM);
             return;
         }
 
-        if (!atoull(conn->in->rextra, &val)) {
+        if (!parse_ttl(conn->in, cmd, &val)) {
             LC_DEBUG(("Invalid timeout param in CMD_SET\r\n"));
             send_response(conn, INVALID_PARAM);
             return;
         }
+        it->timer.expiry = conn->in->received + val;
+        if (it->timer.expiry < val) {
+            it->timer.expiry = UINT64_MAX; // saturate, never expires
+        }
 
         // add to cache
-        ret = hset(cache, conn->in->rkey, conn->in->req_header.request.key_length, conn->in);
+        pthread_mutex_lock(&sh->lock);
+        sh->stats.cmd_set++;
+        it->gen = shard_gen(sh, conn->in->received);
+        ret = hset(sh->cache, ITEM_KEY(it), it->klen, it->hash, it);
+        if ((ret == HERROR) && sh->sketch && !admit_item(sh, it->cls, conn->in)) {
+            pthread_mutex_unlock(&sh->lock);
+            send_response(conn, SUCCESS); // not cached, like DROP_REJECTED
+            return;
+        }
+        if ((ret == HERROR) && evict_item(sh, it->cls)) { // the table is out of memory, too
+            ret = hset(sh->cache, ITEM_KEY(it), it->klen, it->hash, it);
+        }
         if (ret == HERROR) {
+            pthread_mutex_unlock(&sh->lock);
             send_response(conn, OUT_OF_MEMORY);
             return;
         } else if (ret == HEXISTS) { // key exists? then force-update the data
-            tab_item = hget(cache, conn->in->rkey, conn->in->req_header.request.key_length);
+            tab_item = hget(sh->cache, ITEM_KEY(it), it->klen, it->hash);
             assert(tab_item != NULL);
-            del_cached_req(tab_item);
-            tab_item->val = conn->in; // update with the new request
+            unlink_item(sh, tab_item);
+            tab_item->key = ITEM_KEY(it); // the old key may be freed
+            tab_item->val = it;
         }
-        conn->in->can_free = 0;
+        shard_lru_link(sh, it);
+        if (it->timer.expiry != UINT64_MAX) {
+            wheel_add(&sh->expiry, &it->timer, it->timer.expiry);
+        }
+        conn->in->item = NULL; // owned by the cache now
+        pthread_mutex_unlock(&sh->lock);
 
         send_response(conn, SUCCESS);
         break;
@@ -341,22 +802,47 @@ static void execute_cmd(struct conn* conn)
 
         LC_DEBUG(("CMD_DELETE [%s]\r\n", conn->in->rkey));
 
-        tab_item = hget(cache, conn->in->rkey, conn->in->req_header.request.key_length);
+        pthread_mutex_lock(&sh->lock);
+        tab_item = hget(sh->cache, conn->in->rkey, conn->in->req_header.request.key_length, conn->in->hash);
         if (!tab_item) {
+            pthread_mutex_unlock(&sh->lock);
             LC_DEBUG(("Key not found:%s\r\n", conn->in->rkey));
             send_response(conn, KEY_NOTEXISTS);
             return;
         }
+        it = (item *)tab_item->val;
+        i = (it->gen != shard_gen(sh, conn->in->received)); // flushed already?
 
-        del_cached_req(tab_item);        
-        hfree(cache, tab_item);
+        unlink_item(sh, tab_item);
+        hfree(sh->cache, tab_item);
+        pthread_mutex_unlock(&sh->lock);
 
-        send_response(conn, SUCCESS);
+        send_response(conn, i ? KEY_NOTEXISTS : SUCCESS);
         break;
     case CMD_FLUSH_ALL:
         LC_DEBUG(("CMD_FLUSH_ALL\r\n"));
 
-        henum(cache, flush_item_enum, NULL, 1);
+        /* an optional delay, in secs like the TTL of CMD_SET */
+        val = 0;
+        if (conn->in->req_header.request.extra_length) {
+            if (!parse_ttl(conn->in, CMD_SET, &val)) {
+                LC_DEBUG(("Invalid flush delay:%s\r\n", conn->in->rextra));
+                send_response(conn, INVALID_PARAM);
+                break;
+            }
+        }
+        val += conn->in->received;
+        if (val < conn->in->received) {
+            val = UINT64_MAX; // saturate, never flushes
+        }
+
+        // O(1) per shard, the flushed items are reclaimed by the workers.
+        for(i=0; i<shard_count(); i++) {
+            sh = shard_get(i);
+            pthread_mutex_lock(&sh->lock);
+            shard_flush(sh, val);
+            pthread_mutex_unlock(&sh->lock);
+        }
 
         send_response(conn, SUCCESS);
         break;
@@ -365,7 +851,7 @@ static void execute_cmd(struct conn* conn)
         LC_DEBUG(("CHG_SETTING\r\n"));
 
         /* validate params */
-        if (!conn->in->rdata) {
+        if (!conn->in->item) {
             LC_DEBUG(("(null) data param in CMD_CHG_SETTING\r\n"));
             send_response(conn, INVALID_PARAM);
             break;
@@ -373,13 +859,45 @@ static void execute_cmd(struct conn* conn)
 
         /* process */
         if (strcmp(conn->in->rkey, "idle_conn_timeout") == 0) {
-            if (!atoull(conn->in->rdata, &val)) {
+            if (!atoull(ITEM_DATA(conn->in->item), &val)) {
                 LC_DEBUG(("Invalid idle conn timeout param.\r\n"));
                 send_response(conn, INVALID_PARAM);
                 return;
             }
             LC_DEBUG(("SET idle conn timeout :%llu\r\n", (long long unsigned int)val));
-            settings.idle_conn_timeout = val;
+            old = SETTING_LOAD(idle_conn_timeout);
+            SETTING_STORE(idle_conn_timeout, val);
+            // the other connections are armed again by their workers at the
+            // next audit, a longer timeout is seen when their timers expire.
+            if (val < old) {
+                __atomic_add_fetch(&idle_epoch, 1, __ATOMIC_RELEASE);
+            }
+            event_timer_set(conn, conn_deadline(conn));
+        } else if (strcmp(conn->in->rkey, "slab_automove") == 0) {
+            if (strcmp(ITEM_DATA(conn->in->item), "0") == 0) {
+                val = 0;
+            } else if (!atoull(ITEM_DATA(conn->in->item), &val)) {
+                send_response(conn, INVALID_PARAM);
+                return;
+            }
+            SETTING_STORE(slab_automove, (val != 0));
+        } else if (strcmp(conn->in->rkey, "slabs_reassign") == 0) {
+            // a slab of the class of values of the given size is freed for
+            // the other classes at the next rebalance of every arena.
+            if (!atoull(ITEM_DATA(conn->in->item), &val) || (val >= PROTOCOL_MAX_DATA_SIZE)) {
+                send_response(conn, INVALID_PARAM);
+                return;
+            }
+            if (settings.use_sys_malloc && !shard_get(0)->arena) {
+                send_response(conn, INVALID_STATE); // no slabs
+                return;
+            }
+            for(i=0; i<shard_count(); i++) {
+                sh = shard_get(i);
+                pthread_mutex_lock(&sh->lock);
+                sh->reassign = shard_class(sh, ITEM_SIZE(0, val));
+                pthread_mutex_unlock(&sh->lock);
+            }
         } else {
             LC_DEBUG(("Invalid setting received :%s\r\n", conn->in->rkey));
             send_response(conn, INVALID_PARAM);
@@ -393,12 +911,20 @@ static void execute_cmd(struct conn* conn)
 
         /* validate params */
         if (strcmp(conn->in->rkey, "idle_conn_timeout") == 0) {
-            ival = li_malloc(sizeof(uint64_t));
+            ival = malloc(sizeof(uint64_t));
+            if (!ival) {
+                send_response(conn, OUT_OF_MEMORY);
+                return;
+            }
+            *ival = htonll(SETTING_LOAD(idle_conn_timeout));
+            add_response(conn, ival, sizeof(uint64_t), SUCCESS);
+        } else if (strcmp(conn->in->rkey, "slab_automove") == 0) {
+            ival = malloc(sizeof(uint64_t));
             if (!ival) {
                 send_response(conn, OUT_OF_MEMORY);
                 return;
             }
-            *ival = htonll(settings.idle_conn_timeout);
+            *ival = htonll((uint64_t)SETTING_LOAD(slab_automove));
             add_response(conn, ival, sizeof(uint64_t), SUCCESS);
         } else {
             LC_DEBUG(("Invalid setting received :%s\r\n", conn->in->rkey));
@@ -409,32 +935,97 @@ static void execute_cmd(struct conn* conn)
     case CMD_GET_STATS:
 
         LC_DEBUG(("GET_STATS\r\n"));
-        sval = li_malloc(LIGHTCACHE_STATS_SIZE);
+        slen = LIGHTCACHE_STATS_SIZE + shard_count() * LIGHTCACHE_SHARD_STATS_SIZE +
+               LIGHTCACHE_LRU_CLASSES * LIGHTCACHE_CLASS_STATS_SIZE +
+               SLAB_HIST_BUCKETS * LIGHTCACHE_SIZE_STATS_SIZE + LIGHTCACHE_STATS_SIZE;
+        // not from the cache memory, stats are needed most when it is full.
+        sval = malloc(slen);
         if (!sval) {
             send_response(conn, OUT_OF_MEMORY);
             return;
         }
-        sprintf(sval,
-                "mem_used:%llu\r\nmem_avail:%llu\r\nuptime:%lu\r\nversion: %0.1f Build.%d\r\n"
+        sum_stats(&tstats);
+        items = 0;
+        evictions = admitted = rejected = reclaimed = expired_unfetched = stale = moved = 0;
+        mem_used = li_memused();
+        mem_committed = li_memcommitted();
+        for(i=0; i<shard_count(); i++) {
+            sh = shard_get(i);
+            pthread_mutex_lock(&sh->lock);
+            items += hcount(sh->cache);
+            evictions += sh->stats.evictions;
+            admitted += sh->stats.admitted;
+            rejected += sh->stats.rejected;
+            reclaimed += sh->stats.reclaimed;
+            expired_unfetched += sh->stats.expired_unfetched;
+            moved += sh->stats.slabs_moved;
+            shard_gen(sh, conn->in->received);
+            stale += sh->stale;
+            pthread_mutex_unlock(&sh->lock);
+            mem_used += shard_memused(sh);
+            mem_committed += shard_memcommitted(sh);
+        }
+        p = sval + sprintf(sval,
+                "mem_used:%llu\r\nmem_committed:%llu\r\nmem_avail:%llu\r\nuptime:%lu\r\nversion: %0.1f Build.%d\r\n"
                 "pid:%d\r\ntime:%lu\r\ncurr_items:%d\r\ncurr_connections:%llu\r\n"
                 "cmd_get:%llu\r\ncmd_set:%llu\r\nget_misses:%llu\r\nget_hits:%llu\r\n"
-                "bytes_read:%llu\r\nbytes_written:%llu\r\n",
-                (long long unsigned int)li_memused(),
+                "evictions:%llu\r\nadmission:%d\r\nadmitted:%llu\r\nrejected:%llu\r\n"
+                "reclaimed:%llu\r\nexpired_unfetched:%llu\r\nstale_items:%llu\r\nslabs_moved:%llu\r\nbytes_read:%llu\r\nbytes_written:%llu\r\nshards:%d\r\n"
+                "numa_nodes:%d\r\nalloc_local:%llu\r\nalloc_remote:%llu\r\n"
+                "conn_memory:%llu\r\nconn_buffers:%llu\r\n",
+                (long long unsigned int)mem_used,
+                (long long unsigned int)mem_committed,
                 (long long unsigned int)settings.mem_avail,
-                (long unsigned int)CURRENT_TIME-stats.start_time,
+                (long unsigned int)CURRENT_TIME-tstats.start_time,
                 LIGHTCACHE_VERSION,
                 LIGHTCACHE_BUILD,
                 getpid(),
                 CURRENT_TIME,
-                hcount(cache),
-                (long long unsigned int)stats.curr_connections,
-                (long long unsigned int)stats.cmd_get,
-                (long long unsigned int)stats.cmd_set,
-                (long long unsigned int)stats.get_misses,
-                (long long unsigned int)stats.get_hits,
-                (long long unsigned int)stats.bytes_read,
-                (long long unsigned int)stats.bytes_written);        
-        add_response(conn, sval, LIGHTCACHE_STATS_SIZE, SUCCESS);
+                items,
+                (long long unsigned int)tstats.curr_connections,
+                (long long unsigned int)tstats.cmd_get,
+                (long long unsigned int)tstats.cmd_set,
+                (long long unsigned int)tstats.get_misses,
+                (long long unsigned int)tstats.get_hits,
+                (long long unsigned int)evictions,
+                settings.admission,
+                (long long unsigned int)admitted,
+                (long long unsigned int)rejected,
+                (long long unsigned int)reclaimed,
+                (long long unsigned int)expired_unfetched,
+                (long long unsigned int)stale,
+                (long long unsigned int)moved,
+                (long long unsigned int)tstats.bytes_read,
+                (long long unsigned int)tstats.bytes_written,
+                shard_count(),
+                settings.numa_nodes,
+                (long long unsigned int)tstats.alloc_local,
+                (long long unsigned int)tstats.alloc_remote,
+                (long long unsigned int)tstats.conn_memory,
+                (long long unsigned int)tstats.conn_buffers);
+
+        // per-shard breakdown, to spot an imbalanced keyspace.
+        for(i=0; i<shard_count(); i++) {
+            sh = shard_get(i);
+            pthread_mutex_lock(&sh->lock);
+            p += sprintf(p,
+                    "shard%d:items=%d,cmd_get=%llu,cmd_set=%llu,get_hits=%llu,get_misses=%llu,"
+                    "evictions=%llu,mem_used=%llu,cpu=%d,node=%d\r\n",
+                    i,
+                    hcount(sh->cache),
+                    (long long unsigned int)sh->stats.cmd_get,
+                    (long long unsigned int)sh->stats.cmd_set,
+                    (long long unsigned int)sh->stats.get_hits,
+                    (long long unsigned int)sh->stats.get_misses,
+                    (long long unsigned int)sh->stats.evictions,
+                    (long long unsigned int)shard_memused(sh),
+                    sh->cpu,
+                    sh->node);
+            pthread_mutex_unlock(&sh->lock);
+        }
+        p = class_stats(p);
+        p = size_stats(p);
+        add_response(conn, sval, p - sval, SUCCESS);
         break;
     default:
         LC_DEBUG(("Unrecognized command.[%d]\r\n", cmd));
@@ -445,34 +1036,94 @@ static void execute_cmd(struct conn* conn)
     return;
 
 GET_KEY_NOTEXISTS:
-    stats.get_misses++;
+    STATS_ADD(get_misses, 1);
     send_response(conn, KEY_NOTEXISTS);
     return;
 }
 
-void disconnect_idle_conns(void)
+/* Called when the timer of a connection expires. Activity only updates
+ * last_heard, so the timer may have expired for an older deadline and is
+ * armed again for the current one. */
+static void conn_timer(conn *conn)
 {
-    conn *conn, *next;
+    uint64_t now, deadline;
 
-    conn=conns;
-    while( conn != NULL && !conn->free && !conn->listening) {
-        next = conn->next;
-        if ((unsigned int)(CURRENT_TIME - conn->last_heard) > settings.idle_conn_timeout) {
-            LC_DEBUG(("idle conn detected. idle timeout:%llu\r\n", (long long unsigned int)settings.idle_conn_timeout));
-            disconnect_conn(conn);
-            //TODO: move free items closer to head for faster searching for free items in make_conn
+    now = CURRENT_TIME_MS;
+    if (idle_deadline(conn, SETTING_LOAD(idle_conn_timeout)) <= now) {
+        LC_DEBUG(("idle conn detected. idle timeout:%llu\r\n", (long long unsigned int)SETTING_LOAD(idle_conn_timeout)));
+        disconnect_conn(conn);
+        return;
+    }
+    if (conn_deadline(conn) <= now) {
+        release_buffers(conn);
+    }
+    deadline = conn_deadline(conn);
+    if (deadline <= now) {
+        // a request or response is in progress, see release_buffers().
+        deadline = now + LIGHTCACHE_CONN_RELEASE_TIME * 1000;
+        if (deadline > idle_deadline(conn, SETTING_LOAD(idle_conn_timeout))) {
+            deadline = idle_deadline(conn, SETTING_LOAD(idle_conn_timeout));
         }
-        conn=next;
     }
+    event_timer_set(conn, deadline);
 }
 
-socket_state read_nbytes(conn*conn, char *bytes, size_t total)
+/* The timers of the connections are armed for the idle timeout at the time,
+ * they are armed again once it was lowered. */
+static void rearm_conns(void)
+{
+    conn *conn;
+    uint64_t epoch;
+
+    epoch = __atomic_load_n(&idle_epoch, __ATOMIC_ACQUIRE);
+    if (epoch == idle_epoch_seen) {
+        return;
+    }
+    idle_epoch_seen = epoch;
+    for(conn=conns; conn; conn=conn->next) {
+        if (!conn->listening) {
+            event_timer_set(conn, conn_deadline(conn));
+        }
+    }
+}
+
+/* Records released beyond what is worth keeping go back to the memory. */
+static void trim_free_conns(void)
+{
+    conn *conn;
+
+    while (nfree_conns > LIGHTCACHE_CONN_FREE_MAX) {
+        conn = free_conns;
+        free_conns = conn->next;
+        nfree_conns--;
+        li_free(conn);
+        STATS_SUB(conn_memory, sizeof(struct conn));
+    }
+}
+
+/* Reads as many bytes as the socket has ready into the input buffer of the
+ * connection with a single read() call. The parser then consumes them from
+ * there, so pipelined requests do not cost a syscall each. */
+socket_state read_conn(conn *conn)
 {
-    unsigned int needed;
     int nbytes;
 
-    needed = total - conn->in->rbytes;
-    nbytes = read(conn->fd, &bytes[conn->in->rbytes], 1);
+    if (!conn->bufs && !alloc_buffers(conn)) {
+        LC_DEBUG(("connection buffers cannot be allocated.\r\n"));
+        return READ_ERR;
+    }
+
+    /* move the unparsed bytes to the start of the buffer. */
+    if (conn->rcurr) {
+        conn->rlen -= conn->rcurr;
+        memmove(conn->rbuf, &conn->rbuf[conn->rcurr], conn->rlen);
+        conn->rcurr = 0;
+    }
+    if (conn->rlen == LIGHTCACHE_READ_BUFFER_SIZE) {
+        return NEED_MORE;
+    }
+
+    nbytes = event_read(conn, &conn->rbuf[conn->rlen], LIGHTCACHE_READ_BUFFER_SIZE - conn->rlen);
     if (nbytes == 0) {
         return READ_ERR;
     } else if (nbytes == -1) {
@@ -480,11 +1131,34 @@ socket_state read_nbytes(conn*conn, char *bytes, size_t total)
             LC_DEBUG(("socket read EWOUDLBLOCK, EAGAIN.\r\n"));
             return NEED_MORE;
         }
+        LC_DEBUG(("socket read error.[%s]\r\n", strerror(errno)));
+        return READ_ERR;
+    }
+
+    STATS_ADD(bytes_read, nbytes);
+    conn->rlen += nbytes;
+
+    return READ_COMPLETED;
+}
+
+/* Copies the bytes of the current request part from the input buffer. A part
+ * that is split between reads is resumed at conn->in->rbytes. */
+socket_state read_nbytes(conn*conn, char *bytes, size_t total)
+{
+    unsigned int needed, avail;
+
+    needed = total - conn->in->rbytes;
+    avail = conn->rlen - conn->rcurr;
+    if (needed > avail) {
+        needed = avail;
     }
 
-    stats.bytes_read += nbytes;
+    if (bytes) { // NULL skips the bytes
+        memcpy(&bytes[conn->in->rbytes], &conn->rbuf[conn->rcurr], needed);
+    }
+    conn->rcurr += needed;
 
-    conn->in->rbytes += nbytes;
+    conn->in->rbytes += needed;
     if (conn->in->rbytes == total) {
         conn->in->rbytes = 0;
         return READ_COMPLETED;
@@ -493,14 +1167,30 @@ socket_state read_nbytes(conn*conn, char *bytes, size_t total)
     return NEED_MORE;
 }
 
+/* Parses the buffered input. Requests that arrived together in the buffer are
+ * executed one after another and their responses are queued, until the buffer
+ * is drained or the output queue cannot be flushed. */
 int try_read_request(conn* conn)
 {
     socket_state ret;
 
-    switch(conn->state) {
-    case READ_HEADER:        
-        ret = read_nbytes(conn, (char *)conn->in->req_header.bytes, sizeof(req_header));
-        if (ret == READ_COMPLETED) {
+    if (!conn->bufs) { // released while idle, nothing is buffered
+        return NEED_MORE;
+    }
+    for (;;) {
+        switch(conn->state) {
+        case READ_HEADER:
+            if (conn->nout == LIGHTCACHE_OUTPUT_QUEUE_SIZE) {
+                ret = try_send_response(conn);
+                if (ret != SEND_COMPLETED) {
+                    return ret;
+                }
+            }
+
+            ret = read_nbytes(conn, (char *)conn->in->req_header.bytes, sizeof(req_header));
+            if (ret != READ_COMPLETED) {
+                return ret;
+            }
 
             /* convert network2host byte ordering before using in our code. */
             conn->in->req_header.request.data_length = ntohl(conn->in->req_header.request.data_length);
@@ -511,75 +1201,116 @@ int try_read_request(conn* conn)
                     (conn->in->req_header.request.extra_length >= PROTOCOL_MAX_EXTRA_SIZE) ) {
                 LC_DEBUG(("request data or key length exceeded maximum allowed\r\n"));
                 send_response(conn, INVALID_PARAM_SIZE);
-                return FAILED;
+                set_conn_state(conn, READ_HEADER);
+                break;
             }
 
-            // need2 read key?
-            if (conn->in->req_header.request.key_length == 0) {
-                set_conn_state(conn, CMD_RECEIVED);
-                execute_cmd(conn);
-            } else {
+            // need2 read key? requests without one may still have extra data.
+            if (conn->in->req_header.request.key_length) {
                 set_conn_state(conn, READ_KEY);
+            } else if (conn->in->req_header.request.extra_length) {
+                set_conn_state(conn, READ_EXTRA);
+            } else {
+                set_conn_state(conn, CMD_RECEIVED);
             }
-        }
-        break;
-    case READ_KEY:
-        assert(conn->in);
-        assert(conn->in->rkey);
-        assert(conn->in->req_header.request.key_length);
+            break;
+        case READ_KEY:
+            assert(conn->in);
+            assert(conn->in->req_header.request.key_length);
 
-        ret = read_nbytes(conn, conn->in->rkey, conn->in->req_header.request.key_length);
+            ret = read_nbytes(conn, conn->in->rkey, conn->in->req_header.request.key_length);
+            if (ret != READ_COMPLETED) {
+                return ret;
+            }
+            // hashed once here, the cache and the shards re-use it.
+            conn->in->hash = hhash(conn->in->rkey, conn->in->req_header.request.key_length);
+            conn->in->shard = shard_of(conn->in->hash);
 
-        if (ret == READ_COMPLETED) {
-            if (conn->in->req_header.request.data_length == 0) {
-                set_conn_state(conn, CMD_RECEIVED);
-                execute_cmd(conn);
-            } else {
+            if (conn->in->req_header.request.data_length) {
                 set_conn_state(conn, READ_DATA);
+            } else if (conn->in->req_header.request.extra_length) {
+                set_conn_state(conn, READ_EXTRA);
+            } else {
+                set_conn_state(conn, CMD_RECEIVED);
+            }
+            break;
+        case READ_DATA:
+            assert(conn->in);
+            assert(conn->in->item || conn->in->drop);
+            assert(conn->in->req_header.request.data_length);
+
+            ret = read_nbytes(conn, conn->in->item ? ITEM_DATA(conn->in->item) : NULL,
+                              conn->in->req_header.request.data_length);
+            if (ret != READ_COMPLETED) {
+                return ret;
             }
-        }
-        break;
-    case READ_DATA:
-        assert(conn->in);
-        assert(conn->in->rdata);
-        assert(conn->in->req_header.request.data_length);
-
-        ret = read_nbytes(conn, conn->in->rdata, conn->in->req_header.request.data_length);
 
-        if (ret == READ_COMPLETED) {
             if (conn->in->req_header.request.extra_length) { // do we have extra data?
                 set_conn_state(conn, READ_EXTRA);
             } else {
                 set_conn_state(conn, CMD_RECEIVED);
-                execute_cmd(conn);
             }
-        }
-        break;
-    case READ_EXTRA:
-        ret = read_nbytes(conn, conn->in->rextra, conn->in->req_header.request.extra_length);
-        if (ret == READ_COMPLETED) {
+            break;
+        case READ_EXTRA:
+            ret = read_nbytes(conn, conn->in->rextra, conn->in->req_header.request.extra_length);
+            if (ret != READ_COMPLETED) {
+                return ret;
+            }
             set_conn_state(conn, CMD_RECEIVED);
+            break;
+        case CMD_RECEIVED:
             execute_cmd(conn);
-        }
-        break;
-    default:
-        LC_DEBUG(("Invalid state in try_read_request\r\n"));
-        ret = FAILED;
-        send_response(conn, INVALID_STATE);
-        break;
-    } // switch(conn->state)
+            set_conn_state(conn, READ_HEADER);
+            break;
+        case CONN_CLOSED:
+            return READ_ERR;
+        default:
+            LC_DEBUG(("Invalid state in try_read_request\r\n"));
+            send_response(conn, INVALID_STATE);
+            set_conn_state(conn, READ_HEADER);
+            return FAILED;
+        } // switch(conn->state)
+    }
+}
 
-    return ret;
+static unsigned int add_iov(struct iovec *iov, void *base, size_t len, unsigned int *skip)
+{
+    if (*skip >= len) {
+        *skip -= len;
+        return 0;
+    }
+    iov->iov_base = (char *)base + *skip;
+    iov->iov_len = len - *skip;
+    *skip = 0;
+    return 1;
 }
 
-socket_state send_nbytes(conn*conn, char *bytes, size_t total)
+/* Writes all queued responses, headers and values, with a single writev()
+ * call. conn->sbytes holds how much of the queue is already written. */
+int try_send_response(conn *conn)
 {
-    int needed, nbytes;
+    struct iovec iov[2*LIGHTCACHE_OUTPUT_QUEUE_SIZE];
+    unsigned int i, iovcnt, skip, total, dlen;
+    ssize_t nbytes;
+    response *resp;
+
+    if (!conn->nout) {
+        return SEND_COMPLETED;
+    }
 
-    //LC_DEBUG(("send_nbytes called.[left:%ld, fd:%d]\r\n", total - conn->out.sbytes, conn->fd));
+    iovcnt = total = 0;
+    skip = conn->sbytes;
+    for(i=0; i<conn->nout; i++) {
+        resp = &conn->out[i];
+        dlen = ntohl(resp->resp_header.response.data_length);
+        iovcnt += add_iov(&iov[iovcnt], resp->resp_header.bytes, sizeof(resp_header), &skip);
+        if (dlen) {
+            iovcnt += add_iov(&iov[iovcnt], resp->sdata, dlen, &skip);
+        }
+        total += sizeof(resp_header) + dlen;
+    }
 
-    needed = total - conn->out.sbytes;
-    nbytes = write(conn->fd, &bytes[conn->out.sbytes], 1); //needed
+    nbytes = writev(conn->fd, iov, iovcnt);
     if (nbytes == -1) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
             return NEED_MORE;
@@ -589,57 +1320,54 @@ socket_state send_nbytes(conn*conn, char *bytes, size_t total)
         return SEND_ERR;
     }
 
-    stats.bytes_written += nbytes;
+    STATS_ADD(bytes_written, nbytes);
 
-    conn->out.sbytes += nbytes;
-    if (conn->out.sbytes == total) {
-        conn->out.sbytes = 0;
+    conn->sbytes += nbytes;
+    if (conn->sbytes == total) {
+        free_responses(conn);
         return SEND_COMPLETED;
     }
 
     return NEED_MORE;
 }
 
-int try_send_response(conn *conn)
+/* Waits for writability while responses are queued, for readability
+ * otherwise. The flags are only changed when they differ. */
+static void update_events(conn *conn)
 {
-    socket_state ret;
+    int flags;
 
-    switch(conn->state) {
+    flags = conn->nout ? EVENT_WRITE : EVENT_READ;
+    if (conn->events != flags) {
+        event_set(conn, flags);
+        conn->events = flags;
+    }
+}
 
-    case SEND_HEADER:
-        ret = send_nbytes(conn, (char *)conn->out.resp_header.bytes, sizeof(resp_header));
-        if (ret == SEND_COMPLETED) {
-            if (ntohl(conn->out.resp_header.response.data_length) != 0) {
-                set_conn_state(conn, SEND_DATA);
-            } else {
-                set_conn_state(conn, CMD_SENT);
-                set_conn_state(conn, READ_HEADER);// wait for new commands
-            }
-        }
-        break;
-    case SEND_DATA:
-        ret = send_nbytes(conn, conn->out.sdata, ntohl(conn->out.resp_header.response.data_length));
-        if (ret == SEND_COMPLETED) {
-            set_conn_state(conn, CMD_SENT);
-            set_conn_state(conn, READ_HEADER);// wait for new commands
+/* Executes the buffered requests and flushes their responses. */
+static void process_conn(conn *conn)
+{
+    socket_state ret;
+
+    ret = try_read_request(conn);
+    if ((ret == READ_ERR) || (ret == SEND_ERR)) {
+        if (conn->state != CONN_CLOSED) {
+            disconnect_conn(conn);
         }
-        break;
-    default:
-        LC_DEBUG(("Invalid state in try_send_response %d\r\n", conn->state));
-        ret = FAILED;
-        send_response(conn, INVALID_STATE);
-        break;
+        return;
     }
 
-    return ret;
+    if (try_send_response(conn) == SEND_ERR) {
+        disconnect_conn(conn);
+        return;
+    }
 
+    update_events(conn);
 }
 
 void event_handler(conn *conn, event ev)
 {
     int conn_sock;
-    unsigned int slen;
-    struct sockaddr_in si_other;
     socket_state sock_state;
 
     /* check if connection is closed, this may happen where a READ and WRITE
@@ -649,16 +1377,17 @@ void event_handler(conn *conn, event ev)
         return;
     }
 
-    conn->last_heard = CURRENT_TIME;
-
-    slen = sizeof(si_other);
+    conn->last_heard = CURRENT_TIME_MS;
 
     switch(ev) {
     case EVENT_READ:
         if (conn->listening) { // listening socket?
-            conn_sock = accept(conn->fd, (struct sockaddr *)&si_other, &slen);
+            conn_sock = event_accept(conn);
             if (conn_sock == -1) {
-                syslog(LOG_ERR, "%s (%s)", "socket accept  error.", strerror(errno));
+                // workers sharing a unix socket race for the connection.
+                if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                    syslog(LOG_ERR, "%s (%s)", "socket accept  error.", strerror(errno));
+                }
                 return;
             }
             if (make_nonblocking(conn_sock)) {
@@ -669,13 +1398,18 @@ void event_handler(conn *conn, event ev)
                 close(conn_sock);
                 return;
             }
+            event_timer_set(conn, conn_deadline(conn));
             set_conn_state(conn, READ_HEADER);
+            if (conn->state != CONN_CLOSED) {
+                update_events(conn);
+            }
         } else {
-            sock_state = try_read_request(conn);
+            sock_state = read_conn(conn);
             if (sock_state == READ_ERR) {
                 disconnect_conn(conn);
                 return;
             }
+            process_conn(conn);
         }
 
         break;
@@ -685,6 +1419,10 @@ void event_handler(conn *conn, event ev)
             disconnect_conn(conn);
             return;
         }
+        // continue with the pipelined requests that are already buffered.
+        if (sock_state == SEND_COMPLETED) {
+            process_conn(conn);
+        }
         break;
     }
     return;
@@ -702,12 +1440,14 @@ void collect_unused_memory(void)
 }
 
 
+/* Creates a listening socket and returns its fd, -1 on error. With multiple
+ * workers every worker gets its own TCP socket bound with SO_REUSEPORT, so the
+ * kernel distributes incoming connections between them. */
 static int init_server_socket(void)
 {
     int s, optval, ret;
     struct sockaddr_in si_me;
     struct sockaddr_un su_me;
-    struct conn *conn;
     struct stat tstat;
     struct linger ling = {0, 0};
 
@@ -721,12 +1461,12 @@ static int init_server_socket(void)
 
         if ((s=socket(AF_UNIX, SOCK_STREAM, 0))==-1) {
             syslog(LOG_ERR, "%s (%s)", "unix socket make error.", strerror(errno));
-            return 0;
+            return -1;
         }
     } else {
         if ((s=socket(AF_INET, SOCK_STREAM, 0))==-1) {
             syslog(LOG_ERR, "%s (%s)", "socket make error.", strerror(errno));
-            return 0;
+            return -1;
         }
     }
 
@@ -755,6 +1495,14 @@ static int init_server_socket(void)
         if (ret != 0) {
             syslog(LOG_ERR, "setsockopt(TCP_NODELAY) error.(%s)", strerror(errno));
         }
+        if (settings.num_threads > 1) {
+            ret = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+            if (ret != 0) {
+                syslog(LOG_ERR, "setsockopt(SO_REUSEPORT) error.(%s)", strerror(errno));
+                close(s);
+                return -1;
+            }
+        }
     }
 
     if (settings.socket_path) {
@@ -765,7 +1513,7 @@ static int init_server_socket(void)
             LC_DEBUG(("%s (%s)\r\n", "socket bind error.", strerror(errno)));
             syslog(LOG_ERR, "%s (%s)", "socket bind error.", strerror(errno));
             close(s);
-            return 0;
+            return -1;
         }
     } else {
         memset((char *) &si_me, 0, sizeof(si_me));
@@ -776,7 +1524,7 @@ static int init_server_socket(void)
             LC_DEBUG(("%s (%s)\r\n", "socket bind error.", strerror(errno)));
             syslog(LOG_ERR, "%s (%s)", "socket bind error.", strerror(errno));
             close(s);
-            return 0;
+            return -1;
         }
     }
 
@@ -787,30 +1535,653 @@ static int init_server_socket(void)
     if (listen(s, LIGHTCACHE_LISTEN_BACKLOG) == -1) {
         syslog(LOG_ERR, "%s (%s)", "socket listen error.", strerror(errno));
         close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+#ifdef __linux__
+/* Reads a sysfs list like "0-3,8-11" into set. Returns the number of
+ * entries, 0 if the file cannot be read. */
+static int read_sys_list(const char *path, cpu_set_t *set)
+{
+    FILE *f;
+    char buf[1024], *p, *end;
+    long a, b;
+
+    f = fopen(path, "r");
+    if (!f) {
         return 0;
     }
-    conn = make_conn(s);
-    if (!conn) {
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    CPU_ZERO(set);
+    while (p && *p) {
+        a = b = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            b = strtol(p, &end, 10);
+        }
+        for (; a <= b && a < CPU_SETSIZE; a++) {
+            CPU_SET(a, set);
+        }
+        p = (*end == ',') ? end + 1 : NULL;
+    }
+    return CPU_COUNT(set);
+}
+#endif
+
+/* NUMA nodes of the system, 1 if it cannot be told. */
+static int numa_node_count(void)
+{
+#ifdef __linux__
+    int n;
+    cpu_set_t nodes;
+
+    n = read_sys_list("/sys/devices/system/node/online", &nodes);
+    return n ? n : 1;
+#else
+    return 1;
+#endif
+}
+
+/* Pins the calling worker to a CPU, returns the CPU or -1. Workers are spread
+ * over the NUMA nodes in turn and over the CPUs of a node, w->node is set to
+ * the node of the worker. Simulated nodes are only assigned. */
+static int pin_worker(worker *w)
+{
+#ifdef __linux__
+    int i, cpu, nth;
+    long ncpus;
+    char path[64];
+    cpu_set_t set;
+
+    w->node = w->id % settings.numa_nodes;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) {
+        w->node = -1;
+        return -1;
+    }
+    cpu = w->id % ncpus;
+    if (!numa_simulated && (settings.numa_nodes > 1)) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", w->node);
+        if (read_sys_list(path, &set)) {
+            nth = (w->id / settings.numa_nodes) % CPU_COUNT(&set);
+            for (i=0; i<CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &set) && (nth-- == 0)) {
+                    cpu = i;
+                    break;
+                }
+            }
+        }
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        syslog(LOG_ERR, "worker cannot be pinned to cpu %d.", cpu);
+        w->node = -1;
+        return -1;
+    }
+    return cpu;
+#else
+    w->node = -1;
+    return -1;
+#endif
+}
+
+/* Sets up the shards owned by the worker: shard i is owned by worker
+ * i % num_threads. In sharded mode the worker is pinned to a CPU and creates
+ * the slab arenas of its shards, bound to the NUMA node of the worker.
+ * Returns after all workers are ready, as values must not be allocated from a
+ * shard before its arena exists. */
+static int init_worker_shards(worker *w)
+{
+    int i, cpu, ret;
+    shard *sh;
+
+    ret = 1;
+    w->node = -1;
+    if (settings.num_shards > 1) {
+        cpu = pin_worker(w);
+        numa_node = w->node;
+        for(i=w->id; i<shard_count(); i+=settings.num_threads) {
+            sh = shard_get(i);
+            sh->cpu = cpu;
+            sh->node = w->node;
+            if (shard_arena_size &&
+                    !shard_init_arena(sh, shard_arena_size,
+                                      (numa_simulated || settings.numa_nodes < 2) ? -1 : w->node)) {
+                syslog(LOG_ERR, "slab arena of shard %d cannot be initialized.", i);
+                ret = 0;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ready_lock);
+    if (++ready_workers == settings.num_threads) {
+        pthread_cond_broadcast(&ready_cond);
+    }
+    while (ready_workers < settings.num_threads) {
+        pthread_cond_wait(&ready_cond, &ready_lock);
+    }
+    pthread_mutex_unlock(&ready_lock);
+
+    return ret;
+}
+
+// called by the expiry wheel of a shard, the shard lock is held.
+static void reclaim_item(wheel_node *node, void *arg)
+{
+    shard *sh;
+    item *it;
+    _hitem *tab_item;
+
+    sh = (shard *)arg;
+    it = ITEM_OF_TIMER(node);
+    tab_item = hget(sh->cache, ITEM_KEY(it), it->klen, it->hash);
+    assert(tab_item != NULL);
+    assert(tab_item->val == it);
+
+    sh->stats.reclaimed++;
+    if (!(it->flags & ITEM_FETCHED)) {
+        sh->stats.expired_unfetched++;
+    }
+    unlink_item(sh, tab_item);
+    hfree(sh->cache, tab_item);
+}
+
+// frees at most budget flushed items. They are never bumped, so they are at
+// the tails of the LRU lists. The shard lock is held.
+static unsigned int reclaim_stale_items(shard *sh, unsigned int budget)
+{
+    int cls;
+    unsigned int n;
+    uint32_t gen;
+    item *it;
+    _hitem *tab_item;
+
+    n = 0;
+    gen = shard_gen(sh, CURRENT_TIME_MS);
+    for (cls=0; cls<LIGHTCACHE_LRU_CLASSES && sh->stale && n<budget; cls++) {
+        while (n < budget) {
+            it = shard_lru_tail(sh, cls);
+            if (!it || (it->gen == gen)) {
+                break;
+            }
+            tab_item = hget(sh->cache, ITEM_KEY(it), it->klen, it->hash);
+            assert(tab_item != NULL);
+            assert(tab_item->val == it);
+            unlink_item(sh, tab_item);
+            hfree(sh->cache, tab_item);
+            sh->stats.reclaimed++;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Frees the expired and flushed items of the shards the worker owns. Items
+ * are reclaimed in batches, so that the shard lock is not held for long,
+ * until there are no more or the time budget is used. Returns 1 if items are
+ * left for the next call. */
+static int reclaim_items(worker *w)
+{
+    int i;
+    unsigned int n;
+    uint64_t start;
+    shard *sh;
+
+    start = current_time_ms();
+    for(i=w->id; i<shard_count(); i+=settings.num_threads) {
+        sh = shard_get(i);
+        do {
+            if (current_time_ms() - start >= LIGHTCACHE_RECLAIM_TIME) {
+                return 1;
+            }
+            pthread_mutex_lock(&sh->lock);
+            n = wheel_expire(&sh->expiry, CURRENT_TIME_MS, LIGHTCACHE_RECLAIM_BATCH, reclaim_item, sh);
+            n += reclaim_stale_items(sh, LIGHTCACHE_RECLAIM_BATCH - n);
+            pthread_mutex_unlock(&sh->lock);
+        } while (n == LIGHTCACHE_RECLAIM_BATCH);
+    }
+    return 0;
+}
+
+// the table entry of the item a chunk of a draining slab holds, with the shard
+// of the item locked. Chunks of the default arena may hold anything else, so a
+// chunk is only taken for an item if the table holds it under its hash.
+// Returns NULL if it is not one.
+static _hitem *chunk_item(void *chunk, size_t size, int cls, shard **ish)
+{
+    uint64_t hash;
+    item *it;
+    shard *sh;
+    _hitem *tab_item;
+
+    // the chunk may be written by another worker meanwhile, filling a new
+    // item or holding something else. Only the header fields stored
+    // atomically are read, until the table holds the chunk as an item of
+    // the shard: then it is set, and stable under the lock.
+    it = (item *)chunk;
+    if ((size < sizeof(item)) || (__atomic_load_n(&it->cls, __ATOMIC_RELAXED) != cls) ||
+            (sizeof(item) + __atomic_load_n(&it->klen, __ATOMIC_RELAXED) + 1 > size)) {
+        return NULL;
+    }
+    hash = __atomic_load_n(&it->hash, __ATOMIC_RELAXED);
+    sh = shard_of(hash);
+    pthread_mutex_lock(&sh->lock);
+    tab_item = hgetval(sh->cache, hash, it);
+    if (!tab_item) {
+        pthread_mutex_unlock(&sh->lock);
+        return NULL;
+    }
+    *ish = sh;
+    return tab_item;
+}
+
+// takes a slab from the class of the arena of sh and evicts its items, so that
+// any class can use it. If a chunk is not an item, like a chunk of the default
+// arena holding a connection, the slab is given back before anything is
+// evicted. Items being sent are freed after that, and the slab with them.
+// Returns 1 if the slab was taken.
+static int drain_slab(shard *sh, int cls)
+{
+    int slab, pass;
+    unsigned int idx;
+    size_t size;
+    void *chunk;
+    shard *ish;
+    _hitem *tab_item;
+
+    slab = shard_drain(sh, cls);
+    if (slab < 0) {
         return 0;
     }
+    for (pass=0; pass<2; pass++) {
+        idx = 0;
+        while ((chunk = shard_drain_chunk(sh, slab, &idx, &size)) != NULL) {
+            tab_item = chunk_item(chunk, size, cls, &ish);
+            if (!tab_item) {
+                if (pass == 0) {
+                    shard_undrain(sh, slab);
+                    return 0;
+                }
+                continue; // unlinked since the first pass
+            }
+            if (pass == 1) {
+                unlink_item(ish, tab_item);
+                hfree(ish->cache, tab_item);
+            }
+            pthread_mutex_unlock(&ish->lock);
+        }
+    }
 
-    conn->listening = 1;
-    event_set(conn, EVENT_READ);
+    pthread_mutex_lock(&sh->lock);
+    sh->stats.slabs_moved++;
+    pthread_mutex_unlock(&sh->lock);
+    LC_DEBUG(("slab of class %d is reassigned\r\n", cls));
+
+    return 1;
+}
+
+/* Rebalances the slabs of the arena of n shards from first on. A requested
+ * reassignment is done first. With automove, the counters of the shards are
+ * reset and a slab is moved if a class was starved since the last time: the
+ * donor is the class with the most slabs among the ones with items that did
+ * not evict, every class keeps a slab. */
+static void rebalance_arena(int first, int n, int automove)
+{
+    int i, cls, dst, src, reassign;
+    uint32_t starved[LIGHTCACHE_LRU_CLASSES];
+    unsigned int slabs[LIGHTCACHE_LRU_CLASSES];
+    uint64_t donors;
+    shard *sh;
+
+    memset(starved, 0, sizeof(starved));
+    donors = 0;
+    reassign = -1;
+    for(i=first; i<first+n; i++) {
+        sh = shard_get(i);
+        pthread_mutex_lock(&sh->lock);
+        for(cls=0; cls<LIGHTCACHE_LRU_CLASSES; cls++) {
+            starved[cls] += sh->starved[cls];
+            if (automove) {
+                sh->starved[cls] = 0;
+            }
+            if (shard_lru_tail(sh, cls)) {
+                donors |= (uint64_t)1 << cls;
+            }
+        }
+        if (sh->reassign != -1) {
+            reassign = sh->reassign;
+            sh->reassign = -1;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    sh = shard_get(first);
+    if (reassign != -1) {
+        drain_slab(sh, reassign);
+    }
+    if (!automove) {
+        return;
+    }
+
+    dst = -1;
+    for(cls=0; cls<LIGHTCACHE_LRU_CLASSES; cls++) {
+        slabs[cls] = shard_slabs(sh, cls);
+        if (starved[cls]) {
+            donors &= ~((uint64_t)1 << cls);
+            if ((dst == -1) || (starved[cls] > starved[dst])) {
+                dst = cls;
+            }
+        }
+    }
+    if (dst == -1) {
+        return;
+    }
+    for (;;) {
+        src = -1;
+        for(cls=0; cls<LIGHTCACHE_LRU_CLASSES; cls++) {
+            if ((donors & ((uint64_t)1 << cls)) && (slabs[cls] > 1) &&
+                ((src == -1) || (slabs[cls] > slabs[src]))) {
+                src = cls;
+            }
+        }
+        if ((src == -1) || drain_slab(sh, src)) {
+            break;
+        }
+        donors &= ~((uint64_t)1 << src);
+    }
+}
+
+/* Slab rebalancing: the slabs a class took stay with it when the sizes of the
+ * values change, while a class with few slabs keeps evicting. Every arena is
+ * rebalanced by the worker owning its shard, the default arena by the first
+ * worker for all the shards. */
+static void rebalance_slabs(worker *w, int automove)
+{
+    int i;
+
+    if (!shard_get(0)->arena) {
+        if (w->id == 0) {
+            rebalance_arena(0, shard_count(), automove);
+        }
+        return;
+    }
+    for(i=w->id; i<shard_count(); i+=settings.num_threads) {
+        rebalance_arena(i, 1, automove);
+    }
+}
+
+// moves the item a chunk of a draining slab holds to another chunk of its
+// class, the LRU list, the expiry wheel and the table are pointed to the copy.
+// Returns 0 if the chunk is not an item or the item is being sent, and so
+// cannot move.
+static int relocate_item(void *chunk, size_t size, int cls)
+{
+    item *it, *nit;
+    shard *sh;
+    _hitem *tab_item;
+
+    tab_item = chunk_item(chunk, size, cls, &sh);
+    if (!tab_item) {
+        return 0;
+    }
+    it = (item *)chunk;
+    nit = NULL;
+    if (!it->refcount) {
+        nit = (item *)shard_malloc(sh, ITEM_SIZE(it->klen, it->dlen));
+    }
+    if (!nit) {
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+    // a copy, the header fields chunk_item() reads are stored atomically.
+    nit->timer = it->timer;
+    nit->prev = it->prev;
+    nit->next = it->next;
+    nit->refcount = it->refcount;
+    nit->dlen = it->dlen;
+    nit->gen = it->gen;
+    nit->flags = it->flags;
+    __atomic_store_n(&nit->hash, it->hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&nit->klen, it->klen, __ATOMIC_RELAXED);
+    __atomic_store_n(&nit->cls, it->cls, __ATOMIC_RELAXED);
+    memcpy(ITEM_KEY(nit), ITEM_KEY(it), it->klen + it->dlen + 2);
+    shard_lru_replace(sh, it, nit);
+    wheel_replace(&it->timer, &nit->timer);
+    tab_item->key = ITEM_KEY(nit);
+    tab_item->val = nit;
+    free_item(it);
+    pthread_mutex_unlock(&sh->lock);
 
     return 1;
 }
 
+// starts to compact the sparsest slab of the most fragmented class with items
+// in the arena of n shards from first on. Returns 0 if no class is fragmented
+// enough, then the skipped classes are tried again by the next call.
+static int start_compaction(int first, int n)
+{
+    int i, cls, best;
+    uint64_t items;
+    slab_class_stats_t cs, bcs;
+    shard *sh;
+
+    items = 0;
+    for(i=first; i<first+n; i++) {
+        sh = shard_get(i);
+        pthread_mutex_lock(&sh->lock);
+        for(cls=0; cls<LIGHTCACHE_LRU_CLASSES; cls++) {
+            if (shard_lru_tail(sh, cls)) {
+                items |= (uint64_t)1 << cls;
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    sh = shard_get(first);
+    best = -1;
+    for(cls=0; cls<LIGHTCACHE_LRU_CLASSES; cls++) {
+        if (!(items & ((uint64_t)1 << cls)) || (sh->compact_skip & ((uint64_t)1 << cls))) {
+            continue;
+        }
+        // the other slabs must have room for the items of the sparsest one.
+        if (!shard_class_stats(sh, cls, &cs) || (cs.chunks_free < cs.chunks_perslab) ||
+            (cs.chunks_free < cs.slabs * cs.chunks_perslab / LIGHTCACHE_COMPACT_RATIO)) {
+            continue;
+        }
+        if ((best == -1) || ((uint64_t)cs.chunks_free * bcs.slabs * bcs.chunks_perslab >
+                             (uint64_t)bcs.chunks_free * cs.slabs * cs.chunks_perslab)) {
+            best = cls;
+            bcs = cs;
+        }
+    }
+    if (best == -1) {
+        sh->compact_skip = 0;
+        return 0;
+    }
+
+    sh->compact_slab = shard_drain(sh, best);
+    if (sh->compact_slab == -1) {
+        return 0;
+    }
+    sh->compact_cls = best;
+    sh->compact_idx = 0;
+    pthread_mutex_lock(&sh->lock);
+    sh->compaction[best].free = bcs.chunks_free;
+    sh->compaction[best].total = bcs.slabs * bcs.chunks_perslab;
+    pthread_mutex_unlock(&sh->lock);
+
+    return 1;
+}
+
+/* Compacts a slab of the arena of n shards from first on until start +
+ * LIGHTCACHE_COMPACT_TIME. If an item cannot move, the slab is given back and
+ * its class is skipped for a while. Returns 1 if the slab is left for the
+ * next call. */
+static int compact_arena(int first, int n, uint64_t start)
+{
+    int done;
+    unsigned int moved;
+    size_t size;
+    void *chunk;
+    shard *sh;
+
+    sh = shard_get(first);
+    if ((sh->compact_slab == -1) && !start_compaction(first, n)) {
+        return 0;
+    }
+
+    moved = 0;
+    done = 1;
+    while ((chunk = shard_drain_chunk(sh, sh->compact_slab, &sh->compact_idx, &size)) != NULL) {
+        if (!relocate_item(chunk, size, sh->compact_cls)) {
+            shard_undrain(sh, sh->compact_slab);
+            sh->compact_skip |= (uint64_t)1 << sh->compact_cls;
+            done = -1;
+            break;
+        }
+        moved++;
+        if (current_time_ms() - start >= LIGHTCACHE_COMPACT_TIME) {
+            done = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    sh->compaction[sh->compact_cls].relocated += moved;
+    if (done == 1) {
+        sh->compaction[sh->compact_cls].slabs++;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (done) {
+        sh->compact_slab = -1;
+    }
+    return !done;
+}
+
+/* Online defragmentation: churn leaves the slabs of a class with a few items
+ * each, and a slab is only free for the other classes once all of them are
+ * gone. The items of the sparsest slab of the most fragmented class are moved
+ * into the other slabs of the class, in steps of LIGHTCACHE_COMPACT_TIME
+ * msecs. The arenas are compacted by the workers rebalancing them. Returns 1
+ * if a slab is left for the next call. */
+static int compact_slabs(worker *w)
+{
+    int i, backlog;
+    uint64_t start;
+
+    start = current_time_ms();
+    if (!shard_get(0)->arena) {
+        return (w->id == 0) ? compact_arena(0, shard_count(), start) : 0;
+    }
+    backlog = 0;
+    for(i=w->id; i<shard_count(); i+=settings.num_threads) {
+        backlog |= compact_arena(i, 1, start);
+    }
+    return backlog;
+}
+
+/* Runs the event loop of a worker. Every worker owns an event loop, a
+ * listening socket, its connections and its stats; the cache shards and the
+ * default allocator are shared. */
+static void *worker_loop(void *arg)
+{
+    worker *w;
+    struct conn *conn;
+    uint64_t ctime, ptime, rtime, btime;
+    int backlog;
+
+    w = (worker *)arg;
+    update_time();
+
+    init_stats();
+    __atomic_store_n(&w->stats, &stats, __ATOMIC_RELEASE); // initialized first
+
+    if (!init_worker_shards(w)) {
+        goto err;
+    }
+
+    if (!event_init(event_handler, conn_timer)) {
+        goto err;
+    }
+
+    conn = make_conn(w->listen_fd);
+    if (!conn) {
+        goto err;
+    }
+    conn->listening = 1;
+    update_events(conn);
+
+    ptime = rtime = btime = 0;
+    backlog = 0;
+    for (;;) {
+
+        ctime = CURRENT_TIME_MS / 1000;
+
+        // no waiting for events while there is a backlog.
+        event_process(backlog ? 0 : POLL_TIMEOUT);
+
+        // every sec, and between the events while there is a backlog.
+        if ((ctime != rtime) || backlog) {
+            backlog = reclaim_items(w) | compact_slabs(w);
+            rtime = ctime;
+        }
+
+        if (ctime-ptime > 1) {
+
+            // Note: This code is executed per-sec roughly. Audits below can hold another variable to count
+            // how many seconds elapsed to invoke themselves or not.
+
+            trim_free_conns();
+            rearm_conns();
+
+            if (SETTING_LOAD(slab_automove) && (ctime - btime >= LIGHTCACHE_REBALANCE_INTERVAL)) {
+                rebalance_slabs(w, 1);
+                btime = ctime;
+            } else {
+                rebalance_slabs(w, 0);
+            }
+
+            if ( (li_memused() * 100 / settings.mem_avail) > LIGHTCACHE_GARBAGE_COLLECT_RATIO_THRESHOLD) {
+                collect_unused_memory();
+            }
+
+            ptime = ctime;
+        }
+
+
+    }
+
+    return NULL;
+err:
+    syslog(LOG_ERR, "worker thread cannot be initialized.");
+    syslog(LOG_INFO, "lightcache stopped.");
+    closelog();
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
-    int ret, c;
-    time_t ctime, ptime;
+    int ret, c, i;
     uint64_t param;    
+    size_t mem_size;
     struct rlimit rlp;
+    unsigned int layout[SLAB_MAX_LAYOUT], layout_count;
+    char *tok;
 
     init_settings();
 
+    hseed(random_seed());
+
     /* get cmd line args */
-    while (-1 != (c = getopt(argc, argv, "m: d: s: l:"))) {
+    while (-1 != (c = getopt(argc, argv, "m: d: s: l: t: n: c: N: a L"))) {
         switch (c) {
         case 'm':
             ret = atoull(optarg, &param);
@@ -829,12 +2200,79 @@ int main(int argc, char **argv)
         case 'l':
             settings.fd_limit = atoi(optarg);
             break;
+        case 't':
+            settings.num_threads = atoi(optarg);
+            if ((settings.num_threads < 1) || (settings.num_threads > LIGHTCACHE_MAX_THREADS)) {
+                syslog(LOG_ERR, "Worker thread count not in range.");
+                goto err;
+            }
+            break;
+        case 'n':
+            settings.num_shards = atoi(optarg);
+            if ((settings.num_shards < 1) || (settings.num_shards > LIGHTCACHE_MAX_SHARDS)) {
+                syslog(LOG_ERR, "Shard count not in range.");
+                goto err;
+            }
+            break;
+        case 'a':
+            settings.admission = 1;
+            break;
+        case 'L':
+            slab_set_hugetlb(1);
+            break;
+        case 'N':
+            // simulated nodes, to see the placement on a single node system.
+            settings.numa_nodes = atoi(optarg);
+            if ((settings.numa_nodes < 1) || (settings.numa_nodes > LIGHTCACHE_MAX_THREADS)) {
+                syslog(LOG_ERR, "NUMA node count not in range.");
+                goto err;
+            }
+            numa_simulated = 1;
+            break;
+        case 'c':
+            // chunk sizes, as the slab_layout line of GET_STATS.
+            layout_count = 0;
+            for(tok=strtok(optarg, ","); tok; tok=strtok(NULL, ",")) {
+                if ((layout_count == SLAB_MAX_LAYOUT) || !atoull(tok, &param) ||
+                        (param > SLAB_SIZE)) {
+                    syslog(LOG_ERR, "Slab layout not in range.");
+                    goto err;
+                }
+                layout[layout_count++] = (unsigned int)param;
+            }
+            if (!slab_set_layout(layout, layout_count)) {
+                syslog(LOG_ERR, "Slab layout chunk sizes shall be ascending.");
+                goto err;
+            }
+            // every class has an LRU list in the shards.
+            if (slab_class_count(SLAB_SIZE_FACTOR) > LIGHTCACHE_LRU_CLASSES) {
+                syslog(LOG_ERR, "Slab layout has more than %d classes.", LIGHTCACHE_LRU_CLASSES);
+                goto err;
+            }
+            break;
         }
     }
+    if (!settings.numa_nodes) {
+        settings.numa_nodes = numa_node_count();
+    }
     
+    // with multiple shards, the memory is split evenly between the shard arenas
+    // and the default allocator, which holds the keys and connection buffers.
+    mem_size = settings.mem_avail/1024/1024;
+    if (settings.num_shards > 1) {
+        shard_arena_size = mem_size / (settings.num_shards + 1);
+        if (shard_arena_size < LIGHTCACHE_SHARD_MIN_ARENA) {
+            fprintf(stderr, "WARNING: at least %u MB of memory per shard is required "
+                "for per-shard slab arenas, shards share the default allocator.\r\n",
+                LIGHTCACHE_SHARD_MIN_ARENA);
+            shard_arena_size = 0;
+        }
+        mem_size -= shard_arena_size * settings.num_shards;
+    }
+
     // try to initialize the slab allocator. If slabs cannot uniformly distributed 
     // to all caches, then fallback to system's malloc 
-    if (!init_cache_manager(settings.mem_avail/1024/1024, SLAB_SIZE_FACTOR)) {
+    if (!init_cache_manager(mem_size, SLAB_SIZE_FACTOR)) {
         fprintf(stderr, "WARNING: falling back to system malloc.[%u,%u:%llu]\r\n", 
                 slab_stats.slab_count, slab_stats.cache_count, 
                 (unsigned long long)settings.mem_avail/1024/1024);
@@ -849,7 +2287,7 @@ int main(int argc, char **argv)
             settings.use_sys_malloc = 1;
         } else {
             LC_DEBUG(("using slab allocator with %llu MB of memory.\r\n", 
-                (unsigned long long int)settings.mem_avail/1024/1024));
+                (unsigned long long int)mem_size));
         }  
     }
     
@@ -867,8 +2305,6 @@ int main(int argc, char **argv)
     syslog(LOG_ERR, "INFO: current system open file limit is %d.\r\n", 
             settings.fd_limit); 
     
-    init_stats();
-
     init_log();
 
     if (settings.deamon_mode) {
@@ -882,50 +2318,37 @@ int main(int argc, char **argv)
 
     signal(SIGPIPE, SIG_IGN);
 
-    ret = event_init(event_handler);
-    if (!ret) {
+    /* create the in-memory hash tables, one per shard. */
+    update_time();
+    if (!init_shards(settings.num_shards)) {
         goto err;
     }
 
-    /* init listening socket. */
-    if (!init_server_socket()) {
-        goto err;
-    }
-
-    /* create the in-memory hash table. Constant is not important here.
-     * Hash table is an exponantially growing as more and more items being
-     * added.
-     * */
-    cache = htcreate(4);
-    if (!cache) {
-        goto err;
+    /* init listening sockets. A unix domain socket path can only be bound
+     * once, so the workers share it. */
+    for(i=0; i<settings.num_threads; i++) {
+        workers[i].id = i;
+        if (settings.socket_path && i > 0) {
+            workers[i].listen_fd = dup(workers[0].listen_fd);
+        } else {
+            workers[i].listen_fd = init_server_socket();
+        }
+        if (workers[i].listen_fd == -1) {
+            goto err;
+        }
     }
 
-    LC_DEBUG(("lightcache started.[%s]\r\n", settings.socket_path));
-
-    ptime = 0;
-    for (;;) {
-
-        ctime = CURRENT_TIME;
+    LC_DEBUG(("lightcache started.[%s, %d threads, %d shards]\r\n", settings.socket_path,
+              settings.num_threads, settings.num_shards));
 
-        event_process();
-
-        if (ctime-ptime > 1) {
-
-            // Note: This code is executed per-sec roughly. Audits below can hold another variable to count
-            // how many seconds elapsed to invoke themselves or not.
-
-            disconnect_idle_conns();
-
-            if ( (li_memused() * 100 / settings.mem_avail) > LIGHTCACHE_GARBAGE_COLLECT_RATIO_THRESHOLD) {
-                collect_unused_memory();
-            }
-
-            ptime = ctime;
+    for(i=1; i<settings.num_threads; i++) {
+        ret = pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+        if (ret != 0) { // the error is returned, errno is not set
+            syslog(LOG_ERR, "%s (%s)", "worker thread create error.", strerror(ret));
+            goto err;
         }
-
-
     }
+    worker_loop(&workers[0]); // main thread is the first worker.
        
 err:
     syslog(LOG_INFO, "lightcache stopped.");
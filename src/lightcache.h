@@ -37,6 +37,11 @@ struct settings {
     char *socket_path; /* path to the unix domain socket */
     int use_sys_malloc; /* indicate whether to use sys malloc or our slab allocator. */
     int fd_limit; /* system open file limit */
+    int num_threads; /* number of worker threads, each with its own event loop */
+    int num_shards; /* number of cache partitions */
+    int admission; /* TinyLFU admission filter in front of the eviction */
+    int slab_automove; /* slabs are moved to the classes that evict the most */
+    int numa_nodes; /* NUMA nodes the workers are spread over */
 };
 
 struct stats {
@@ -50,16 +55,56 @@ struct stats {
     uint64_t get_misses;
     uint64_t bytes_read;
     uint64_t bytes_written;
+    uint64_t alloc_local; /* items allocated from an arena on the node of the worker */
+    uint64_t alloc_remote; /* and on another node */
+    uint64_t conn_memory; /* bytes of the conn records and buffers */
+    uint64_t conn_buffers; /* connections holding buffers */
 };
 
 #define LIGHTCACHE_PORT 13131
 #define LIGHTCACHE_LISTEN_BACKLOG 100
 #define LIGHTCACHE_GARBAGE_COLLECT_RATIO_THRESHOLD 75 /*the ratio threshold that garbage collect functions will start demanding memory.*/
-#define LIGHTCACHE_STATS_SIZE 512
+#define LIGHTCACHE_STATS_SIZE 2048
+#define LIGHTCACHE_READ_BUFFER_SIZE 4096 /* per-connection input buffer, in bytes */
+#define LIGHTCACHE_OUTPUT_QUEUE_SIZE 32 /* max. responses queued per connection before a write */
+#define LIGHTCACHE_CONN_FREE_MAX 1024 /* released conn records a worker keeps for reuse */
+#define LIGHTCACHE_CONN_RELEASE_TIME 2 /* secs without traffic after which a connection releases its buffers */
 #define SLAB_SIZE_FACTOR 1.25
+#define LIGHTCACHE_MAX_THREADS 256
+#define LIGHTCACHE_MAX_SHARDS 256
+#define LIGHTCACHE_SHARD_STATS_SIZE 256 /* GET_STATS bytes per shard */
+#define LIGHTCACHE_SHARD_MIN_ARENA 64 /* min. MB for a shard to get a slab arena of its own */
+#define LIGHTCACHE_LRU_CLASSES 64 /* LRU lists per shard, one per slab class */
+#define LIGHTCACHE_EVICT_TRIES 16 /* max. items evicted for a single allocation */
+#define LIGHTCACHE_MEM_RESERVE_RATIO 16 /* 1/N of the shared memory (or slabs) is not used by items */
+#define LIGHTCACHE_SKETCH_ITEM_SIZE 128 /* bytes per item assumed when sizing the admission sketch */
+#define LIGHTCACHE_SKETCH_MIN_WIDTH 1024
+#define LIGHTCACHE_SKETCH_MAX_WIDTH 65536
+#define LIGHTCACHE_EXPIRY_RESOLUTION 1000 /* msecs per tick of the expiry wheels */
+#define LIGHTCACHE_RECLAIM_BATCH 64 /* expired items reclaimed per shard lock */
+#define LIGHTCACHE_RECLAIM_TIME 10 /* max. msecs a worker spends on reclaiming at once */
+#define LIGHTCACHE_REBALANCE_INTERVAL 10 /* secs between automatic slab moves */
+#define LIGHTCACHE_COMPACT_TIME 5 /* max. msecs a worker spends on compacting slabs at once */
+#define LIGHTCACHE_COMPACT_RATIO 8 /* a class is compacted when 1/N of its chunks are free */
+#define LIGHTCACHE_CLASS_STATS_SIZE 160 /* GET_STATS bytes per slab class */
+#define LIGHTCACHE_SIZE_STATS_SIZE 32 /* GET_STATS bytes per counted allocation size */
+
+/* per-thread storage, every worker thread runs its own event loop. */
+#define LC_THREAD __thread
 
 #endif
 
 extern struct settings settings;
-extern struct stats stats;
+extern LC_THREAD struct stats stats; /* stats of the calling worker thread */
+
+/* The stats of a worker are written by the worker only and read by the
+ * others in GET_STATS, so they are stored and loaded atomically. */
+#define STATS_ADD(field, n) __atomic_store_n(&stats.field, stats.field + (n), __ATOMIC_RELAXED)
+#define STATS_SUB(field, n) __atomic_store_n(&stats.field, stats.field - (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(ws, field) __atomic_load_n(&(ws)->field, __ATOMIC_RELAXED)
+
+/* Settings changed by CHG_SETTING are written by the worker of the request
+ * and read by all of them. */
+#define SETTING_LOAD(field) __atomic_load_n(&settings.field, __ATOMIC_RELAXED)
+#define SETTING_STORE(field, v) __atomic_store_n(&settings.field, (v), __ATOMIC_RELAXED)
 
@@ -2,16 +2,128 @@
 #include "mem.h"
 #include "util.h"
 #include "slab.h"
+#include "pthread.h"
 
 static uint64_t mem_used = 0;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* worker threads share the allocator */
 
 uint64_t li_memused(void)
 {
+    uint64_t used;
+
+    pthread_mutex_lock(&mem_lock);
+    if (!settings.use_sys_malloc) {
+        used = slab_stats.mem_used;
+    } else {
+        used = mem_used;
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    return used;
+}
+
+/* memory of the slabs taken from the system, see commit_slab(). */
+uint64_t li_memcommitted(void)
+{
+    uint64_t committed;
+
+    pthread_mutex_lock(&mem_lock);
+    committed = settings.use_sys_malloc ? 0 : slab_stats.mem_committed;
+    pthread_mutex_unlock(&mem_lock);
+
+    return committed;
+}
+
+/* whether size can be allocated leaving 1/ratio of the memory free. With the
+ * slab allocator, that is 1/ratio of the slabs. */
+int li_has_room(size_t size, unsigned int ratio)
+{
+    int ret;
+
+    pthread_mutex_lock(&mem_lock);
     if (!settings.use_sys_malloc) {
-        return slab_stats.mem_used;
+        ret = schas_room(size, slab_stats.slab_count / ratio + 1);
     } else {
-        return mem_used;
+        ret = (mem_used + size + settings.mem_avail / ratio <= settings.mem_avail);
+    }
+    pthread_mutex_unlock(&mem_lock);
+
+    return ret;
+}
+
+/* Slab re-assignment in the slab allocator, see cmdrain(). There are no
+ * slabs with the system allocator. */
+int li_class_stats(int cls, slab_class_stats_t *cs)
+{
+    int ret;
+
+    if (settings.use_sys_malloc) {
+        return 0;
+    }
+    pthread_mutex_lock(&mem_lock);
+    ret = scclass_stats(cls, cs);
+    pthread_mutex_unlock(&mem_lock);
+
+    return ret;
+}
+
+// adds the allocations counted per size, see cmsize_hist().
+int li_size_hist(uint64_t *hist)
+{
+    if (settings.use_sys_malloc) {
+        return 0;
+    }
+    pthread_mutex_lock(&mem_lock);
+    scsize_hist(hist);
+    pthread_mutex_unlock(&mem_lock);
+
+    return 1;
+}
+
+unsigned int li_slabs(int cls)
+{
+    unsigned int n;
+
+    if (settings.use_sys_malloc) {
+        return 0;
+    }
+    pthread_mutex_lock(&mem_lock);
+    n = scslabs(cls);
+    pthread_mutex_unlock(&mem_lock);
+
+    return n;
+}
+
+int li_drain(int cls)
+{
+    int slab;
+
+    if (settings.use_sys_malloc) {
+        return -1;
     }
+    pthread_mutex_lock(&mem_lock);
+    slab = scdrain(cls);
+    pthread_mutex_unlock(&mem_lock);
+
+    return slab;
+}
+
+void *li_drain_chunk(int slab, unsigned int *idx, size_t *size)
+{
+    void *p;
+
+    pthread_mutex_lock(&mem_lock);
+    p = scdrain_chunk(slab, idx, size);
+    pthread_mutex_unlock(&mem_lock);
+
+    return p;
+}
+
+void li_undrain(int slab)
+{
+    pthread_mutex_lock(&mem_lock);
+    scundrain(slab);
+    pthread_mutex_unlock(&mem_lock);
 }
 
 void *li_malloc(size_t size)
@@ -22,10 +134,12 @@ void *li_malloc(size_t size)
         return NULL;
     }
     
+    pthread_mutex_lock(&mem_lock);
     if (!settings.use_sys_malloc) {
         p = scmalloc(size);
     } else {
         if (size + mem_used > (settings.mem_avail)) {
+            pthread_mutex_unlock(&mem_lock);
             syslog(LOG_ERR, "No memory available![%llu MB]\r\n", (long long unsigned int)settings.mem_avail);
             LC_DEBUG(("No memory available! [%llu, %llu, %u]\r\n", (long long unsigned int)settings.mem_avail,
                       (long long unsigned int)mem_used, (unsigned int)size));
@@ -39,6 +153,7 @@ void *li_malloc(size_t size)
 
         mem_used += size;
     }
+    pthread_mutex_unlock(&mem_lock);
     
 #ifdef MEM_DEBUG
     LC_DEBUG(("Allocated memory.[%p, %u]\r\n", p, (unsigned)size));
@@ -55,6 +170,7 @@ void li_free(void *ptr)
         return;
     }
     
+    pthread_mutex_lock(&mem_lock);
     if (!settings.use_sys_malloc) {
         scfree(ptr);
     } else {
@@ -63,6 +179,7 @@ void li_free(void *ptr)
         mem_used -= size;
         free(ptr);
     }
+    pthread_mutex_unlock(&mem_lock);
 
 #ifdef MEM_DEBUG
     LC_DEBUG(("Freeing memory.[%p, %u]\r\n", ptr, (unsigned)size));
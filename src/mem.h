@@ -1,5 +1,6 @@
 
 #include "lightcache.h"
+#include "slab.h"
 
 #ifndef MEM_H
 #define MEM_H
@@ -7,6 +8,14 @@
 void *li_malloc(size_t size);
 void li_free(void *ptr);
 uint64_t li_memused(void); 
+uint64_t li_memcommitted(void);
+int li_has_room(size_t size, unsigned int ratio);
+int li_class_stats(int cls, slab_class_stats_t *cs);
+int li_size_hist(uint64_t *hist);
+unsigned int li_slabs(int cls);
+int li_drain(int cls);
+void *li_drain_chunk(int slab, unsigned int *idx, size_t *size);
+void li_undrain(int slab);
 
 #endif
 
@@ -2,6 +2,9 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include "stddef.h"
+#include "wheel.h"
+
 #define PROTOCOL_MAX_EXTRA_SIZE 250 // in bytes --
 #define PROTOCOL_MAX_KEY_SIZE 250 // in bytes --
 #define PROTOCOL_MAX_DATA_SIZE 1024 + PROTOCOL_MAX_KEY_SIZE // in bytes -- same as memcached
@@ -25,21 +28,52 @@ typedef union {
     uint8_t bytes[8];
 } resp_header;
 
+/* A cached entry: the header, the key and the value in a single chunk that is
+ * allocated from the shard of the key. The hash table points into it. */
+typedef struct item {
+    wheel_node timer; /* expiry wheel of the shard, timer.expiry is the absolute
+                         time in msecs, expired when passed */
+    uint64_t hash; /* hhash() of the key */
+    struct item *prev; /* LRU list of the shard, while in the cache */
+    struct item *next;
+    unsigned int refcount; /* queued responses sending the value */
+    uint32_t dlen; /* value length */
+    uint32_t gen; /* flush generation of the shard when set, see shard_gen() */
+    uint8_t klen; /* key length */
+    uint8_t flags;
+    uint8_t cls; /* LRU list, see shard_class() */
+    char data[]; /* key, 0, value, 0 */
+}item;
+
+#define ITEM_UNLINKED 0x01 /* removed from the cache, freed when refcount drops to zero */
+#define ITEM_FETCHED 0x02 /* was a GET hit */
+
+#define ITEM_KEY(it) ((it)->data)
+#define ITEM_DATA(it) ((it)->data + (it)->klen + 1)
+#define ITEM_SIZE(klen, dlen) (sizeof(item) + (klen) + (dlen) + 2)
+#define ITEM_OF_TIMER(node) ((item *)((char *)(node) - offsetof(item, timer)))
+
+#define DROP_NOMEM 0x01 /* no memory for the item */
+#define DROP_REJECTED 0x02 /* the admission filter rejected the item */
+
+/* The request being parsed, one per connection and reused. */
 typedef struct request {
     req_header req_header;
-    char *rdata;
-    char *rkey;
-    char *rextra;
+    char rkey[PROTOCOL_MAX_KEY_SIZE];
+    char rextra[PROTOCOL_MAX_EXTRA_SIZE];
+    item *item; /* holds the value, given to the cache by CMD_SET */
+    uint8_t drop; /* the value is skipped instead of read into an item, see DROP_* */
     unsigned int rbytes; /* current recv index */
-    time_t received;
-    int can_free; /* flag to indicate whether data can be freed. */
+    uint64_t received; /* msecs */
+    uint64_t hash; /* hhash() of the key */
+    struct shard *shard; /* shard of the key */
 }request;
 
 typedef struct response {
     resp_header resp_header;
     char *sdata;
-    unsigned int sbytes; /*current write index*/
-    int can_free;
+    int can_free; /* sdata is malloc'ed, freed once sent */
+    item *item; /* cached item that sdata belongs to, if any */
 }response;
 
 typedef enum {
@@ -50,6 +84,7 @@ typedef enum {
     CMD_GET_STATS = 0x04,
     CMD_DELETE = 0x05,
     CMD_FLUSH_ALL = 0x06,
+    CMD_SET_MS = 0x07, /* CMD_SET with a binary TTL: msecs as a 64-bit big-endian extra */
 } protocol_commands;
 
 typedef enum {
@@ -58,10 +93,7 @@ typedef enum {
     READ_DATA = 0x02,
     CONN_CLOSED = 0x03,
     CMD_RECEIVED = 0x04,
-    SEND_HEADER = 0x05,
-    SEND_DATA = 0x06,
     READ_EXTRA = 0x07,
-    CMD_SENT = 0x08,
 } conn_states;
 
 typedef enum {
@@ -74,15 +106,32 @@ typedef enum {
     OUT_OF_MEMORY = 0x06,
 } code_t;
 
+/* The buffers of a connection, allocated when bytes arrive and released when
+ * it is idle, so idle connections only hold their conn record. */
+typedef struct conn_buffers {
+    request in;
+    response out[LIGHTCACHE_OUTPUT_QUEUE_SIZE];
+    char rbuf[LIGHTCACHE_READ_BUFFER_SIZE];
+} conn_buffers;
+
 typedef struct conn {
     int fd;                         /* socket fd */
     uint8_t listening;              /* listening socket? */
     uint8_t free;                   /* recycle connection structure */
-    time_t last_heard;              /* last time we heard from the client */
+    uint64_t last_heard;            /* last time we heard from the client, in msecs */
+    wheel_node timer;               /* idle timer, see conn_timer() */
     conn_states state;              /* state of the connection READ_KEY, READ_HEADER.etc...*/
-    request *in;                    /* request */
-    response out;                   /* response */
-    struct conn *next;              /* next connection in the linked-list of the connections */
+    conn_buffers *bufs;             /* NULL while idle, see alloc_buffers() */
+    char *rbuf;                     /* input buffer in bufs, filled with bulk reads */
+    unsigned int rlen;              /* number of valid bytes in rbuf */
+    unsigned int rcurr;             /* parse index into rbuf */
+    request *in;                    /* request in bufs */
+    response *out;                  /* responses waiting to be written, in bufs */
+    unsigned int nout;              /* number of queued responses */
+    unsigned int sbytes;            /* bytes of the queued responses already written */
+    int events;                     /* event flags currently registered for the fd */
+    struct conn *prev;              /* connections in use of the worker, or the free stack */
+    struct conn *next;
 } conn;
 
 #endif
@@ -0,0 +1,372 @@
+#include "shard.h"
+#include "mem.h"
+#include "protocol.h"
+#include "util.h"
+
+/* globals */
+static shard *shards = NULL;
+static int nshards = 0;
+
+int init_shards(int count)
+{
+    int i;
+    uint64_t width;
+
+    shards = (shard *)li_malloc(count * sizeof(shard));
+    if (!shards) {
+        return 0;
+    }
+    for (i=0; i<count; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_mutex_init(&shards[i].arena_lock, NULL);
+        memset(&shards[i].arena_stats, 0, sizeof(slab_stats_t));
+        memset(&shards[i].stats, 0, sizeof(struct shard_stats));
+        memset(shards[i].lru, 0, sizeof(shards[i].lru));
+        wheel_init(&shards[i].expiry, CURRENT_TIME_MS, LIGHTCACHE_EXPIRY_RESOLUTION);
+        shards[i].gen = 0;
+        shards[i].stale = 0;
+        shards[i].flush_at = 0;
+        memset(shards[i].starved, 0, sizeof(shards[i].starved));
+        shards[i].reassign = -1;
+        memset(shards[i].compaction, 0, sizeof(shards[i].compaction));
+        shards[i].compact_slab = -1;
+        shards[i].compact_skip = 0;
+        shards[i].arena = NULL;
+        shards[i].cpu = -1;
+        shards[i].node = -1;
+
+        shards[i].sketch = NULL;
+        if (settings.admission) {
+            // roughly a counter per item the shard can hold.
+            width = settings.mem_avail / count / LIGHTCACHE_SKETCH_ITEM_SIZE;
+            if (width < LIGHTCACHE_SKETCH_MIN_WIDTH) {
+                width = LIGHTCACHE_SKETCH_MIN_WIDTH;
+            } else if (width > LIGHTCACHE_SKETCH_MAX_WIDTH) {
+                width = LIGHTCACHE_SKETCH_MAX_WIDTH;
+            }
+            shards[i].sketch = sketch_create((unsigned int)width);
+            if (!shards[i].sketch) {
+                return 0;
+            }
+        }
+
+        /* Constant is not important here, tables grow as items are added. */
+        shards[i].cache = htcreate(4);
+        if (!shards[i].cache) {
+            return 0;
+        }
+    }
+    nshards = count;
+
+    return 1;
+}
+
+int shard_count(void)
+{
+    return nshards;
+}
+
+shard *shard_get(int index)
+{
+    assert(index < nshards);
+
+    return &shards[index];
+}
+
+// the tables index with the low bits of the hash, shards are picked with the
+// high bits so that the keys of a shard still use all the buckets of its table.
+shard *shard_of(uint64_t hash)
+{
+    if (nshards == 1) {
+        return &shards[0];
+    }
+    return &shards[(unsigned int)(hash >> 32) % nshards];
+}
+
+/* Gives the shard a slab arena of its own. Slabs are committed by whichever
+ * thread allocates first, so the arena is bound to the NUMA node of the
+ * thread that will use the shard the most. A node of -1 leaves the placement
+ * to the system. */
+int shard_init_arena(shard *sh, size_t memory_limit, int node)
+{
+    sh->arena = create_cache_manager(memory_limit, SLAB_SIZE_FACTOR, &sh->arena_stats);
+    if (!sh->arena) {
+        return 0;
+    }
+    if (sh->arena_stats.slab_count < sh->arena_stats.cache_count) {
+        destroy_cache_manager(sh->arena);
+        sh->arena = NULL;
+        return 0;
+    }
+    if ((node >= 0) && !cmbind(sh->arena, node)) {
+        syslog(LOG_ERR, "slab arena cannot be bound to NUMA node %d.", node);
+    }
+    return 1;
+}
+
+void *shard_malloc(shard *sh, size_t size)
+{
+    void *p;
+
+    if (!sh->arena) {
+        return li_malloc(size);
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    p = cmmalloc(sh->arena, size);
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return p;
+}
+
+void shard_free(shard *sh, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    if (!sh->arena) {
+        li_free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    cmfree(sh->arena, ptr);
+    pthread_mutex_unlock(&sh->arena_lock);
+}
+
+uint64_t shard_memused(shard *sh)
+{
+    uint64_t used;
+
+    if (!sh->arena) {
+        return 0; // accounted in li_memused()
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    used = sh->arena_stats.mem_used;
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return used;
+}
+
+uint64_t shard_memcommitted(shard *sh)
+{
+    uint64_t committed;
+
+    if (!sh->arena) {
+        return 0; // accounted in li_memcommitted()
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    committed = sh->arena_stats.mem_committed;
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return committed;
+}
+
+/* LRU list an allocation of the size belongs to. Evicting from the list frees
+ * memory that the allocation can reuse. With the system allocator, any freed
+ * memory can be reused, so there is a single list. */
+int shard_class(shard *sh, size_t size)
+{
+    int cls;
+
+    if (sh->arena) {
+        cls = cmclass(sh->arena, size);
+    } else if (!settings.use_sys_malloc) {
+        cls = scclass(size);
+    } else {
+        cls = 0;
+    }
+    if (cls < 0) {
+        cls = 0;
+    } else if (cls >= LIGHTCACHE_LRU_CLASSES) {
+        cls = LIGHTCACHE_LRU_CLASSES-1;
+    }
+    return cls;
+}
+
+/* Items of the shards without an arena share the memory with the connections
+ * and the responses. They are evicted before they use up the last part of it,
+ * otherwise a full cache could not accept new connections. */
+int shard_has_room(shard *sh, size_t size)
+{
+    if (sh->arena) {
+        return 1;
+    }
+    return li_has_room(size, LIGHTCACHE_MEM_RESERVE_RATIO);
+}
+
+void shard_lru_link(shard *sh, item *it)
+{
+    struct item_lru *lru;
+
+    lru = &sh->lru[it->cls];
+    it->prev = NULL;
+    it->next = lru->head;
+    if (lru->head) {
+        lru->head->prev = it;
+    } else {
+        lru->tail = it;
+    }
+    lru->head = it;
+}
+
+void shard_lru_unlink(shard *sh, item *it)
+{
+    struct item_lru *lru;
+
+    lru = &sh->lru[it->cls];
+    if (it->prev) {
+        it->prev->next = it->next;
+    } else {
+        lru->head = it->next;
+    }
+    if (it->next) {
+        it->next->prev = it->prev;
+    } else {
+        lru->tail = it->prev;
+    }
+    it->prev = it->next = NULL;
+}
+
+void shard_lru_bump(shard *sh, item *it)
+{
+    if (sh->lru[it->cls].head == it) {
+        return;
+    }
+    shard_lru_unlink(sh, it);
+    shard_lru_link(sh, it);
+}
+
+// it takes the place of old in the list, it is a copy of old at another address.
+void shard_lru_replace(shard *sh, item *old, item *it)
+{
+    struct item_lru *lru;
+
+    lru = &sh->lru[old->cls];
+    if (it->prev) {
+        it->prev->next = it;
+    } else {
+        lru->head = it;
+    }
+    if (it->next) {
+        it->next->prev = it;
+    } else {
+        lru->tail = it;
+    }
+    old->prev = old->next = NULL;
+}
+
+item *shard_lru_tail(shard *sh, int cls)
+{
+    return sh->lru[cls].tail;
+}
+
+// flushes the items set until at. Nothing is freed here: the generation is
+// bumped when the time comes and items of older generations are misses from
+// then on, reclaimed later. The lock is held.
+void shard_flush(shard *sh, uint64_t at)
+{
+    sh->flush_at = at ? at : 1;
+    shard_gen(sh, CURRENT_TIME_MS);
+}
+
+// the generation of the items set now, a due flush is applied first. The
+// lock is held.
+uint32_t shard_gen(shard *sh, uint64_t now)
+{
+    if (sh->flush_at && (now >= sh->flush_at)) {
+        sh->gen++;
+        sh->stale = hcount(sh->cache); // all of them, stale ones included
+        sh->flush_at = 0;
+    }
+    return sh->gen;
+}
+
+/* Slab re-assignment in the arena of the shard, or in the default one. See
+ * cmdrain(). */
+int shard_class_stats(shard *sh, int cls, slab_class_stats_t *cs)
+{
+    int ret;
+
+    if (!sh->arena) {
+        return li_class_stats(cls, cs);
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    ret = cmclass_stats(sh->arena, cls, cs);
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return ret;
+}
+
+int shard_size_hist(shard *sh, uint64_t *hist)
+{
+    if (!sh->arena) {
+        return li_size_hist(hist);
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    cmsize_hist(sh->arena, hist);
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return 1;
+}
+
+unsigned int shard_slabs(shard *sh, int cls)
+{
+    unsigned int n;
+
+    if (!sh->arena) {
+        return li_slabs(cls);
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    n = cmslabs(sh->arena, cls);
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return n;
+}
+
+int shard_drain(shard *sh, int cls)
+{
+    int slab;
+
+    if (!sh->arena) {
+        return li_drain(cls);
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    slab = cmdrain(sh->arena, cls);
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return slab;
+}
+
+void *shard_drain_chunk(shard *sh, int slab, unsigned int *idx, size_t *size)
+{
+    void *p;
+
+    if (!sh->arena) {
+        return li_drain_chunk(slab, idx, size);
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    p = cmdrain_chunk(sh->arena, slab, idx, size);
+    pthread_mutex_unlock(&sh->arena_lock);
+
+    return p;
+}
+
+void shard_undrain(shard *sh, int slab)
+{
+    if (!sh->arena) {
+        li_undrain(slab);
+        return;
+    }
+
+    pthread_mutex_lock(&sh->arena_lock);
+    cmundrain(sh->arena, slab);
+    pthread_mutex_unlock(&sh->arena_lock);
+}
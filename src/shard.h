@@ -0,0 +1,97 @@
+/*
+*    Cache shards
+*
+*    The keyspace is partitioned by a hash of the key. Every shard owns its
+*    hash table, an optional slab arena for the values and its counters, so
+*    workers operating on different shards do not contend with each other.
+*/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "lightcache.h"
+#include "hashtab.h"
+#include "slab.h"
+#include "sketch.h"
+#include "wheel.h"
+#include "pthread.h"
+
+struct shard_stats {
+    uint64_t cmd_get;
+    uint64_t cmd_set;
+    uint64_t get_hits;
+    uint64_t get_misses;
+    uint64_t evictions;
+    uint64_t admitted; /* new items that passed the admission filter to evict */
+    uint64_t rejected; /* new items dropped by the admission filter */
+    uint64_t reclaimed; /* expired or flushed items freed in the background */
+    uint64_t expired_unfetched; /* expired items that were never a GET hit */
+    uint64_t slabs_moved; /* slabs of the arena taken from a class for another */
+};
+
+/* compaction of a slab class in the arena of the shard, see compact_slabs(). */
+struct class_compaction {
+    uint64_t slabs;     /* slabs emptied by moving their items */
+    uint64_t relocated; /* items moved */
+    uint32_t free;      /* free chunks of the class when it was compacted last */
+    uint32_t total;     /* all chunks of the class then */
+};
+
+struct item;
+
+/* items of a slab class, most recently used first. */
+struct item_lru {
+    struct item *head;
+    struct item *tail;
+};
+
+typedef struct shard {
+    pthread_mutex_t lock;       /* guards the table, its cached requests and the stats */
+    pthread_mutex_t arena_lock; /* guards the arena, can be taken while lock is held */
+    _htab *cache;
+    cache_manager_t *arena;     /* NULL when values are allocated with li_malloc() */
+    slab_stats_t arena_stats;
+    struct shard_stats stats;
+    struct item_lru lru[LIGHTCACHE_LRU_CLASSES]; /* guarded by lock */
+    sketch *sketch;             /* access frequencies for the admission, NULL if it is disabled */
+    wheel expiry;               /* items by expiry, guarded by lock */
+    uint32_t gen;               /* items of older generations are flushed */
+    uint64_t stale;             /* flushed items not reclaimed yet */
+    uint64_t flush_at;          /* msecs of a delayed flush, 0 if there is none */
+    uint32_t starved[LIGHTCACHE_LRU_CLASSES]; /* evictions and failed allocations since the last rebalance */
+    int reassign;               /* class to take a slab from at the next rebalance, -1 if none */
+    struct class_compaction compaction[LIGHTCACHE_LRU_CLASSES]; /* guarded by lock */
+    int compact_slab;           /* slab being compacted, -1 if none. Owned by the worker */
+    int compact_cls;
+    unsigned int compact_idx;   /* next chunk of the slab */
+    uint64_t compact_skip;      /* classes not compacted until none is left */
+    int cpu;                    /* CPU the owning worker is pinned to, -1 if not pinned */
+    int node;                   /* NUMA node of the owning worker, -1 if not pinned */
+} shard;
+
+int init_shards(int count);
+int shard_count(void);
+shard *shard_get(int index);
+shard *shard_of(uint64_t hash);
+int shard_init_arena(shard *sh, size_t memory_limit, int node);
+void *shard_malloc(shard *sh, size_t size);
+void shard_free(shard *sh, void *ptr);
+uint64_t shard_memused(shard *sh);
+uint64_t shard_memcommitted(shard *sh);
+int shard_class(shard *sh, size_t size);
+int shard_has_room(shard *sh, size_t size);
+void shard_lru_link(shard *sh, struct item *it);
+void shard_lru_unlink(shard *sh, struct item *it);
+void shard_lru_bump(shard *sh, struct item *it);
+void shard_lru_replace(shard *sh, struct item *old, struct item *it);
+struct item *shard_lru_tail(shard *sh, int cls);
+void shard_flush(shard *sh, uint64_t at);
+uint32_t shard_gen(shard *sh, uint64_t now);
+int shard_class_stats(shard *sh, int cls, slab_class_stats_t *cs);
+int shard_size_hist(shard *sh, uint64_t *hist);
+unsigned int shard_slabs(shard *sh, int cls);
+int shard_drain(shard *sh, int cls);
+void *shard_drain_chunk(shard *sh, int slab, unsigned int *idx, size_t *size);
+void shard_undrain(shard *sh, int slab);
+
+#endif
@@ -0,0 +1,125 @@
+#include "lightcache.h"
+#include "sketch.h"
+#include "mem.h"
+
+// every row takes different bits of a re-mixed hash, so keys colliding in one
+// row rarely collide in the others.
+static inline unsigned int _sindex(sketch *sk, uint64_t hash, int row)
+{
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return ((unsigned int)(hash >> (16 * row)) & sk->mask) + row * sk->width;
+}
+
+// width is rounded up to a power of two.
+sketch *sketch_create(unsigned int width)
+{
+    sketch *sk;
+    unsigned int w;
+
+    sk = (sketch *)li_malloc(sizeof(sketch));
+    if (!sk) {
+        return NULL;
+    }
+    for (w=1; w<width; w<<=1)
+        ;
+    sk->counters = (uint8_t *)li_malloc(SKETCH_DEPTH * w);
+    if (!sk->counters) {
+        li_free(sk);
+        return NULL;
+    }
+    memset(sk->counters, 0, SKETCH_DEPTH * w);
+    sk->width = w;
+    sk->mask = w - 1;
+    sk->additions = 0;
+    sk->sample = w * SKETCH_SAMPLE_FACTOR;
+
+    return sk;
+}
+
+void sketch_destroy(sketch *sk)
+{
+    li_free(sk->counters);
+    li_free(sk);
+}
+
+static void _sage(sketch *sk)
+{
+    unsigned int i;
+
+    for (i=0; i<SKETCH_DEPTH * sk->width; i++) {
+        sk->counters[i] >>= 1;
+    }
+    sk->additions /= 2;
+}
+
+void sketch_add(sketch *sk, uint64_t hash)
+{
+    int i;
+    unsigned int idx;
+
+    for (i=0; i<SKETCH_DEPTH; i++) {
+        idx = _sindex(sk, hash, i);
+        if (sk->counters[idx] < SKETCH_MAX_COUNT) {
+            sk->counters[idx]++;
+        }
+    }
+    if (++sk->additions == sk->sample) {
+        _sage(sk);
+    }
+}
+
+// the minimum of the rows, collisions can only make a count larger.
+unsigned int sketch_estimate(sketch *sk, uint64_t hash)
+{
+    int i;
+    unsigned int c, min;
+
+    min = SKETCH_MAX_COUNT;
+    for (i=0; i<SKETCH_DEPTH; i++) {
+        c = sk->counters[_sindex(sk, hash, i)];
+        if (c < min) {
+            min = c;
+        }
+    }
+    return min;
+}
+
+#ifdef LC_TEST
+void test_sketch(void)
+{
+    int i;
+    sketch *sk;
+    uint64_t hot, cold;
+
+    sk = sketch_create(1000);
+    assert(sk != NULL);
+    assert(sk->width == 1024);
+
+    hot = 0x0123456789ABCDEFULL;
+    cold = 0xFEDCBA9876543210ULL;
+    assert(sketch_estimate(sk, hot) == 0);
+    for (i=0; i<5; i++) {
+        sketch_add(sk, hot);
+    }
+    sketch_add(sk, cold);
+    assert(sketch_estimate(sk, hot) == 5);
+    assert(sketch_estimate(sk, cold) == 1);
+
+    // counters saturate.
+    for (i=0; i<100; i++) {
+        sketch_add(sk, hot);
+    }
+    assert(sketch_estimate(sk, hot) == SKETCH_MAX_COUNT);
+
+    // and are halved after a sample of additions.
+    while (sk->additions != sk->sample - 1) {
+        sketch_add(sk, 42);
+    }
+    sketch_add(sk, 42);
+    assert(sk->additions == sk->sample / 2);
+    assert(sketch_estimate(sk, hot) == SKETCH_MAX_COUNT / 2);
+    assert(sketch_estimate(sk, cold) == 0);
+
+    sketch_destroy(sk);
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+*    Frequency sketch
+*
+*    A count-min sketch of the key hashes with small saturating counters,
+*    used to estimate how often a key was accessed recently. Counters are
+*    halved after a sample of additions, so old popularity fades away.
+*/
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include "stdint.h"
+
+#define SKETCH_DEPTH 4 /* rows, each indexed with a different hash */
+#define SKETCH_MAX_COUNT 15
+#define SKETCH_SAMPLE_FACTOR 10 /* counters are halved after width*factor additions */
+
+typedef struct sketch {
+    uint8_t *counters; /* SKETCH_DEPTH rows of width counters */
+    unsigned int width;
+    unsigned int mask;
+    unsigned int additions;
+    unsigned int sample;
+} sketch;
+
+sketch *sketch_create(unsigned int width);
+void sketch_destroy(sketch *sk);
+void sketch_add(sketch *sk, uint64_t hash);
+unsigned int sketch_estimate(sketch *sk, uint64_t hash);
+
+#ifdef LC_TEST
+void test_sketch(void);
+#endif
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MAP_HUGETLB, madvise() */
 #include "slab.h"
 #include "stdlib.h"
 #include "string.h"
@@ -5,21 +6,48 @@
 #include "math.h"
 #include "limits.h"
 #include "stdio.h"
+#include "sys/mman.h"
+#ifdef __linux__
+#include "unistd.h"
+#include "sys/syscall.h"
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#define SLAB_MPOL_PREFERRED 1 /* MPOL_PREFERRED of mbind() */
+#define SLAB_MAX_NODES 1024
 
 #define WORD_SIZE_IN_BITS (sizeof(word_t) * CHAR_BIT)   // in bits
 #define WORD_COUNT ((SLAB_SIZE / MIN_SLAB_CHUNK_SIZE / WORD_SIZE_IN_BITS)+1)
+#define SUMMARY_COUNT ((WORD_COUNT + WORD_SIZE_IN_BITS - 1) / WORD_SIZE_IN_BITS)
 
 #define SLAB_INIT_MALLOC_ERR "slab allocator initialization failed: malloc failed.\r\n"
+#define SLAB_INIT_CLASSES_ERR "slab allocator initialization failed: too many size classes.\r\n"
 #define SLAB_ALREADY_INIT_ERR "slab allocator initialization failed: already initialized.\r\n"
+#define SLAB_HUGETLB_ERR "no huge pages reserved for the slabs, using transparent huge pages.\r\n"
 
 typedef uint64_t word_t;
+
+// a set bit of words is a free chunk. A bit of summary is set when its word of
+// words has a set bit, and a bit of top when its word of summary has one, so
+// the first set bit is found with three bit scans.
 typedef struct {
+    word_t top;
+    word_t summary[SUMMARY_COUNT];
     word_t words[WORD_COUNT];
 } bitset_t;
 
+// the top word must cover all summary words.
+typedef char summary_fits_top[(SUMMARY_COUNT <= WORD_SIZE_IN_BITS) ? 1 : -1];
+
 typedef struct slab_ctl_t {
     unsigned int nused;
     unsigned int nindex; // index into the slab_ctls. in sync with slabs.
+    int draining; // taken out of its cache's lists to be emptied, see cmdrain().
     bitset_t slots;
     struct slab_ctl_t *next;
     struct slab_ctl_t *prev;
@@ -34,26 +62,39 @@ typedef struct {
 typedef struct cache_t {
     unsigned int chunk_size;
     unsigned int chunk_count_perslab; // for efficiency
+    unsigned int nslabs; // slabs assigned to the cache
+    unsigned int nused; // chunks allocated from them
     list_t slabs_full;
     list_t slabs_partial;
 } cache_t;
 
-typedef struct {
+struct cache_manager_t {
     cache_t *caches;
     unsigned int cache_count;
     slab_ctl_t *slab_ctls;
     unsigned int slabctl_count;
 
     list_t slabs_free;
+    unsigned int nfree; // slabs in slabs_free and the ones not committed yet
+    unsigned int ncommitted; // slabs committed, from the first one on
+
+    void *slabs; // in map, at a huge page boundary
+    void *map;
+    size_t map_size;
+    int hugetlb;
+    slab_stats_t *stats;
 
-    void *slabs;
-} cache_manager_t;
+    uint64_t hist[SLAB_HIST_BUCKETS]; // requests per size, see cmsize_hist()
+};
 
 // Globals
-static cache_manager_t *cm = NULL;
+static cache_manager_t *cm = NULL; // the default arena used by scmalloc()/scfree()
 slab_stats_t slab_stats;
+static unsigned int layout[SLAB_MAX_LAYOUT]; // see slab_set_layout()
+static unsigned int layout_count = 0;
+static int hugetlb = 0; // see slab_set_hugetlb()
 
-static void *malloci(size_t size)
+static void *malloci(slab_stats_t *stats, size_t size)
 {
     void *ptr;
     size_t real_size;
@@ -62,23 +103,22 @@ static void *malloci(size_t size)
     
     // TODO: check for mem limit
     
-    ptr = malloc(real_size);
+    ptr = calloc(1, real_size); // large ones are fresh pages, not touched here
     if (!ptr) {
         return NULL;
     }
-    memset(ptr, 0x00, real_size);
     *(uint64_t *)ptr = real_size;
-    slab_stats.mem_mallocd += real_size;
+    stats->mem_mallocd += real_size;
     return (char *)ptr+sizeof(uint64_t);
 }
 
-static void freei(void *ptr)
+static void freei(slab_stats_t *stats, void *ptr)
 {
     char *real_ptr;
     assert(ptr != NULL);
     
     real_ptr = (char *)ptr - sizeof(uint64_t);
-    slab_stats.mem_mallocd -= *(uint64_t *)(real_ptr);
+    stats->mem_mallocd -= *(uint64_t *)(real_ptr);
     free(real_ptr);
 }
 
@@ -107,15 +147,43 @@ static void dump_bitset(bitset_t *bts)
 
 static void set_bit(bitset_t *bts, unsigned int b)
 {
+    unsigned int w;
+
     assert(b < WORD_COUNT*WORD_SIZE_IN_BITS);
 
-    bts->words[bindex(b)] |= (word_t)1 << (bloffset(b));
+    w = bindex(b);
+    bts->words[w] |= (word_t)1 << (bloffset(b));
+    bts->summary[bindex(w)] |= (word_t)1 << (bloffset(w));
+    bts->top |= (word_t)1 << bindex(w);
 }
 static void clear_bit(bitset_t *bts, unsigned int b)
 {
+    unsigned int w;
+
     assert(b < WORD_COUNT*WORD_SIZE_IN_BITS);
 
-    bts->words[bindex(b)] &= ~((word_t)1 << (bloffset(b)));
+    w = bindex(b);
+    bts->words[w] &= ~((word_t)1 << (bloffset(b)));
+    if (!bts->words[w]) {
+        bts->summary[bindex(w)] &= ~((word_t)1 << (bloffset(w)));
+        if (!bts->summary[bindex(w)]) {
+            bts->top &= ~((word_t)1 << bindex(w));
+        }
+    }
+}
+
+// sets all bits, the summaries only for the words that exist.
+static void fill_bits(bitset_t *bts)
+{
+    unsigned int w;
+
+    memset(bts->words, 0xFF, sizeof(bts->words));
+    memset(bts->summary, 0, sizeof(bts->summary));
+    bts->top = 0;
+    for(w=0; w<WORD_COUNT; w++) {
+        bts->summary[bindex(w)] |= (word_t)1 << (bloffset(w));
+        bts->top |= (word_t)1 << bindex(w);
+    }
 }
 
 static unsigned int get_bit(bitset_t *bts, unsigned int b)
@@ -125,44 +193,24 @@ static unsigned int get_bit(bitset_t *bts, unsigned int b)
     return (bts->words[bindex(b)] >> (bloffset(b))) & 1;
 }
 
-// Among other tested alternatives this is the fastest. The only problem
-// is we may have a cache miss because of the table usage. But this is a
-// O(1) operation as can be seen and very efficient.
-// http://keithandkatie.com/keith/papers/debruijn.pdf can be read for
-// more info. Paper indicates 64 bit mul. can be slower than 32 bit, however
-// for our case with many words, it seems using 64 bit is roughly %20 faster in
-// 64-bit machines. Using below with 32 bit, however, contradicting with the paper
-// have roughly same performance with the 32-bit version.
-static int nlz64(register uint64_t x)
-{
-    static const unsigned int debruij_tab[64] = {
-        0,  1,  2, 53,  3,  7, 54, 27,
-        4, 38, 41,  8, 34, 55, 48, 28,
-        62,  5, 39, 46, 44, 42, 22,  9,
-        24, 35, 59, 56, 49, 18, 29, 11,
-        63, 52,  6, 26, 37, 40, 33, 47,
-        61, 45, 43, 21, 23, 58, 17, 10,
-        51, 25, 36, 32, 60, 20, 57, 16,
-        50, 31, 19, 15, 30, 14, 13, 12,
-    };
-    return debruij_tab[((x&-x)*0x022FDD63CC95386DU) >> 58];
+// index of the lowest set bit of a non-zero word, a single instruction
+// (tzcnt/bsf) on most targets.
+static inline unsigned int ctz64(word_t x)
+{
+    return (unsigned int)__builtin_ctzll(x);
 }
 
+// the first set bit in O(1): top, summary and word are scanned once each.
 static int ff_setbit(bitset_t *bts)
 {
-    unsigned int i;
-    int j;
-    word_t w;
+    unsigned int s, w;
 
-    for(i=0; i<WORD_COUNT; i++) {
-        w = bts->words[i];
-        if(w) {
-            j = nlz64(w);
-            return (j + (i*WORD_SIZE_IN_BITS));
-        }
+    if (!bts->top) {
+        return -1;
     }
-
-    return -1;
+    s = ctz64(bts->top);
+    w = s*WORD_SIZE_IN_BITS + ctz64(bts->summary[s]);
+    return (int)(w*WORD_SIZE_IN_BITS + ctz64(bts->words[w]));
 }
 
 static slab_ctl_t *peek(list_t *li)
@@ -190,54 +238,41 @@ static slab_ctl_t *pop(list_t *li)
     result = NULL;
     if (li->head) {
         result = li->head;
-        li->head->prev = NULL;
         li->head = li->head->next;
+        result->next = NULL;
     }
 
     // check if last item is being popped.
-    if (!li->head) {
+    if (li->head) {
+        li->head->prev = NULL;
+    } else {
         li->tail = NULL;
     }
 
     return result;
 }
 
-static int rem(list_t *li, slab_ctl_t *item)
+// item must be in li, the caller knows the list from the slab's usage.
+static void rem(list_t *li, slab_ctl_t *item)
 {
-    slab_ctl_t *cit;
-
-    for(cit=li->head; cit != NULL; cit = cit->next) {
-        if (cit == item) {
-            if (cit == li->head) {
-                pop(li);
-            } else if (cit == li->tail) {
-
-                // we SHALL have tail->prev here. Because if not, then
-                // li->head == li->tail and if so, above if (cit == li->head)
-                // will capture that.
-                assert(li->tail->prev != NULL);
-
-                li->tail->prev->next = NULL;
-                li->tail = li->tail->prev;
-            } else {
-                cit->prev->next = cit->next;
-                cit->next->prev = cit->prev;
-            }
-            return 1;
-        }
+    if (item->prev) {
+        item->prev->next = item->next;
+    } else {
+        assert(li->head == item);
+        li->head = item->next;
+    }
+    if (item->next) {
+        item->next->prev = item->prev;
+    } else {
+        assert(li->tail == item);
+        li->tail = item->prev;
     }
-
-    return 0;
 }
 
-static int rem_and_push(list_t *src, list_t *dest, slab_ctl_t *item)
+static void rem_and_push(list_t *src, list_t *dest, slab_ctl_t *item)
 {
-    if(rem(src, item)) {
-        push(dest, item);
-        return 1;
-    }
-
-    return 0;
+    rem(src, item);
+    push(dest, item);
 }
 
 static int pop_and_push(list_t *src, list_t *dest)
@@ -301,123 +336,413 @@ static cache_t *size_to_cache(cache_t *arr, unsigned int arr_size, unsigned int
     return NULL;
 }
 
-static void deinit_cache_manager(void)
+static inline unsigned int align_chunk(unsigned int size)
+{
+    if (size % CHUNK_ALIGN_BYTES) {
+        size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    }
+    return size;
+}
+
+// sizes are aligned, the ones below MIN_SLAB_CHUNK_SIZE are raised to it. They
+// must be ascending. A count of zero restores the default layout.
+int slab_set_layout(const unsigned int *sizes, unsigned int count)
+{
+    unsigned int i, size;
+
+    if (count > SLAB_MAX_LAYOUT) {
+        return 0;
+    }
+    for(i=0; i<count; i++) {
+        size = align_chunk(sizes[i] < MIN_SLAB_CHUNK_SIZE ? MIN_SLAB_CHUNK_SIZE : sizes[i]);
+        if ((size > SLAB_SIZE) || (i && (size <= layout[i-1]))) {
+            layout_count = 0;
+            return 0;
+        }
+        layout[i] = size;
+    }
+    layout_count = count;
+    return 1;
+}
+
+void slab_set_hugetlb(int on)
+{
+    hugetlb = on;
+}
+
+// A row of the dynamic programming of slab_layout(): the least waste of the
+// buckets up to j with k sizes, from the one with k-1 sizes in prev.
+typedef struct {
+    const unsigned int *u;
+    const uint64_t *sw, *swu, *prev;
+    uint64_t *cur;
+    unsigned int *from;
+} layout_row_t;
+
+#define WASTE(r, i, j) ((r)->u[j] * ((r)->sw[(j)+1] - (r)->sw[i]) - ((r)->swu[(j)+1] - (r)->swu[i]))
+
+// Fills the row for the buckets lo..hi. The first bucket served by the largest
+// size never moves back when j grows, so it is searched in optlo..opthi and
+// the range is split at the one found for the middle bucket.
+static void layout_row(layout_row_t *r, unsigned int lo, unsigned int hi,
+                       unsigned int optlo, unsigned int opthi)
 {
-    if (cm == NULL) {
+    unsigned int i, mid, last, opt;
+    uint64_t c, best;
+
+    mid = lo + (hi - lo) / 2;
+    last = opthi < mid ? opthi : mid;
+    best = UINT64_MAX;
+    opt = optlo;
+    for(i=optlo; i<=last; i++) {
+        c = r->prev[i-1] + WASTE(r, i, mid);
+        if (c < best) {
+            best = c;
+            opt = i;
+        }
+    }
+    r->cur[mid] = best;
+    r->from[mid] = opt;
+    if (mid > lo) {
+        layout_row(r, lo, mid - 1, optlo, opt);
+    }
+    if (mid < hi) {
+        layout_row(r, mid + 1, hi, opt, opthi);
+    }
+}
+
+// Chunk sizes that waste the least memory for the requests counted in hist: at
+// most count of them, every one is the upper bound of a bucket. Buckets i..j
+// served by the size of j waste the difference of the sizes for every request,
+// the least waste of the buckets up to j with k sizes is found for every j and
+// k with dynamic programming. As the waste of a range grows faster for wider
+// ones, a row takes O(n*log(n)) for n non-empty buckets, see layout_row().
+// Returns the number of sizes.
+unsigned int slab_layout(const uint64_t *hist, unsigned int count, unsigned int *sizes)
+{
+    unsigned int b, n, i, j, k, minb, *u, *from;
+    uint64_t *w, *sw, *swu, *f, c;
+    layout_row_t r;
+
+    u = malloc(SLAB_HIST_BUCKETS * sizeof(unsigned int));
+    w = malloc(SLAB_HIST_BUCKETS * sizeof(uint64_t));
+    if (!u || !w) {
+        free(u);
+        free(w);
+        return 0;
+    }
+    // requests below the smallest chunk size are counted in its bucket.
+    minb = (align_chunk(MIN_SLAB_CHUNK_SIZE) - 1) / CHUNK_ALIGN_BYTES;
+    c = 0;
+    n = 0;
+    for(b=0; b<SLAB_HIST_BUCKETS; b++) {
+        c += hist[b];
+        if ((b >= minb) && c) {
+            u[n] = (b + 1) * CHUNK_ALIGN_BYTES;
+            w[n++] = c;
+            c = 0;
+        }
+    }
+    if (n <= count) {
+        memcpy(sizes, u, n * sizeof(unsigned int));
+        free(u);
+        free(w);
+        return n;
+    }
+    if (!count) {
+        free(u);
+        free(w);
+        return 0;
+    }
+
+    sw = malloc((n + 1) * sizeof(uint64_t));
+    swu = malloc((n + 1) * sizeof(uint64_t));
+    f = malloc(count * n * sizeof(uint64_t));
+    from = malloc(count * n * sizeof(unsigned int));
+    if (!sw || !swu || !f || !from) {
+        count = 0;
+        goto out;
+    }
+    sw[0] = swu[0] = 0;
+    for(i=0; i<n; i++) {
+        sw[i+1] = sw[i] + w[i];
+        swu[i+1] = swu[i] + w[i] * u[i];
+    }
+    r.u = u;
+    r.sw = sw;
+    r.swu = swu;
+    for(j=0; j<n; j++) {
+        f[j] = WASTE(&r, 0, j);
+        from[j] = 0;
+    }
+    for(k=1; k<count; k++) {
+        r.prev = f + (k-1)*n;
+        r.cur = f + k*n;
+        r.from = from + k*n;
+        layout_row(&r, k, n - 1, k, n - 1);
+    }
+
+    // the largest size serves the last bucket, the others are where the
+    // buckets of the larger ones start.
+    j = n - 1;
+    for(k=count; k>0; k--) {
+        sizes[k-1] = u[j];
+        j = from[(k-1)*n + j] - 1;
+    }
+out:
+    free(sw);
+    free(swu);
+    free(f);
+    free(from);
+    free(u);
+    free(w);
+    return count;
+}
+
+#undef WASTE
+
+// Reserves the address space of the slabs, no memory is taken for them until
+// they are committed. Explicit huge pages are only taken from the reserved
+// pool when touched. Otherwise the reservation is over by a huge page, so the
+// slabs can start at a huge page boundary and be on transparent huge pages.
+static int map_slabs(cache_manager_t *m)
+{
+    size_t size;
+    uintptr_t p;
+
+    size = (size_t)m->slabctl_count * SLAB_SIZE;
+#ifdef MAP_HUGETLB
+    if (hugetlb) {
+        m->map_size = (size + SLAB_HUGE_PAGE_SIZE - 1) & ~((size_t)SLAB_HUGE_PAGE_SIZE - 1);
+        m->map = mmap(NULL, m->map_size, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (m->map != MAP_FAILED) {
+            m->slabs = m->map;
+            m->hugetlb = 1;
+            m->stats->mem_mallocd += size;
+            return 1;
+        }
+        fprintf(stderr, SLAB_HUGETLB_ERR);
+    }
+#endif
+    m->map_size = size + SLAB_HUGE_PAGE_SIZE;
+    m->map = mmap(NULL, m->map_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (m->map == MAP_FAILED) {
+        m->map = NULL;
+        return 0;
+    }
+    p = (uintptr_t)m->map;
+    m->slabs = (char *)m->map + (SLAB_HUGE_PAGE_SIZE - p % SLAB_HUGE_PAGE_SIZE) % SLAB_HUGE_PAGE_SIZE;
+#ifdef MADV_HUGEPAGE
+    madvise(m->slabs, size, MADV_HUGEPAGE); // just a hint, THP may be disabled
+#endif
+    m->stats->mem_mallocd += size;
+    return 1;
+}
+
+static void unmap_slabs(cache_manager_t *m)
+{
+    munmap(m->map, m->map_size);
+    m->stats->mem_mallocd -= (size_t)m->slabctl_count * SLAB_SIZE;
+    m->stats->mem_committed = 0;
+}
+
+// slabs of the arena are taken from the memory of the NUMA node while it has
+// free memory, from the other nodes after that. Returns 0 if the policy cannot
+// be set, e.g. on kernels without NUMA support.
+int cmbind(cache_manager_t *m, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[SLAB_MAX_NODES / (sizeof(unsigned long) * CHAR_BIT)];
+
+    if ((node < 0) || (node >= SLAB_MAX_NODES)) {
+        return 0;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / (sizeof(unsigned long) * CHAR_BIT)] = 1UL << (node % (sizeof(unsigned long) * CHAR_BIT));
+    return syscall(SYS_mbind, m->slabs, (size_t)m->slabctl_count * SLAB_SIZE,
+                   SLAB_MPOL_PREFERRED, mask, (unsigned long)SLAB_MAX_NODES + 1, 0) == 0;
+#else
+    if (m && node) {
+        ; // suppress unused param. warning.
+    }
+    return 0;
+#endif
+}
+
+// the next slab of the reservation is committed when the free slabs run out,
+// so the slabs in use stay at the start of it. The memory is made accessible
+// a huge page at a time, a smaller range could not be on a huge page. Returns
+// NULL if all are committed or the system has no memory for the slab.
+static slab_ctl_t *commit_slab(cache_manager_t *m)
+{
+    slab_ctl_t *cslab;
+    size_t off, len;
+
+    if (m->ncommitted == m->slabctl_count) {
+        return NULL;
+    }
+    off = (size_t)m->ncommitted * SLAB_SIZE;
+    if (!m->hugetlb && (off % SLAB_HUGE_PAGE_SIZE == 0)) {
+        len = (size_t)m->slabctl_count * SLAB_SIZE - off;
+        if (len > SLAB_HUGE_PAGE_SIZE) {
+            len = SLAB_HUGE_PAGE_SIZE;
+        }
+        if (mprotect((char *)m->slabs + off, len, PROT_READ|PROT_WRITE) != 0) {
+            return NULL;
+        }
+    }
+    cslab = &m->slab_ctls[m->ncommitted];
+    cslab->nindex = m->ncommitted++;
+    fill_bits(&cslab->slots); // setbit indicates free slot. so set all.
+    m->stats->mem_committed += SLAB_SIZE;
+    return cslab;
+}
+
+void destroy_cache_manager(cache_manager_t *m)
+{
+    slab_stats_t *stats;
+
+    if (m == NULL) {
         return;
     }
-    if (cm->caches != NULL) {
-        freei(cm->caches);
+    stats = m->stats;
+    if (m->caches != NULL) {
+        freei(stats, m->caches);
     }
-    if (cm->slab_ctls != NULL) {
-        freei(cm->slab_ctls);
+    if (m->slab_ctls != NULL) {
+        freei(stats, m->slab_ctls);
     }
-    if (cm->slabs != NULL) {
-        freei(cm->slabs);
+    if (m->map != NULL) {
+        unmap_slabs(m);
     }
-    freei(cm);
+    freei(stats, m);
 
-    cm = NULL;
-    slab_stats.mem_used_metadata = slab_stats.mem_used = slab_stats.mem_limit = 0;
-    slab_stats.cache_count = 0;
-    slab_stats.slab_count = 0;
+    stats->mem_used_metadata = stats->mem_used = stats->mem_limit = 0;
+    stats->cache_count = 0;
+    stats->slab_count = 0;
         
-    assert(slab_stats.mem_mallocd == 0);// all real-mallocd chunks shall be freed here.
+    assert(stats->mem_mallocd == 0);// all real-mallocd chunks shall be freed here.
 }
 
-int init_cache_manager(size_t memory_limit, double chunk_size_factor)
+// Sets the chunk sizes of the classes in caches, if given, and returns their
+// count. The sizes start from MIN_SLAB_CHUNK_SIZE and are multiplied with
+// chunk_size_factor for every class till we reach SLAB_SIZE. This idea is
+// being used on memcached() and proved to be well on real-world. A layout
+// replaces the sizes up to its largest one.
+static unsigned int class_sizes(double chunk_size_factor, cache_t *caches)
 {
-    unsigned int size,i;
-    slab_ctl_t *prev_slab;
-    
-    if (cm != NULL) {
-        fprintf(stderr, SLAB_ALREADY_INIT_ERR);
-        goto err;
+    unsigned int size, i, count, n;
+
+    // TODO: !!!check below cannot return below 0.
+    count = (unsigned int)floor(logbn(chunk_size_factor,
+                                SLAB_SIZE/MIN_SLAB_CHUNK_SIZE))-1;
+    n = 0;
+    for(i=0; i < layout_count; i++, n++) {
+        if (caches) {
+            caches[n].chunk_size = layout[i];
+        }
     }
+    for(i=0,size=MIN_SLAB_CHUNK_SIZE; i < count; size*=chunk_size_factor, i++) {
+        size = align_chunk(size);
+        if (!layout_count || (size > layout[layout_count-1])) {
+            if (caches) {
+                caches[n].chunk_size = size;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+unsigned int slab_class_count(double chunk_size_factor)
+{
+    return class_sizes(chunk_size_factor, NULL);
+}
 
-    // initialize globals
-    slab_stats.mem_limit = memory_limit*1024*1024; // memory_limit is in MB
-    cm = malloci(sizeof(cache_manager_t));
-    if (!cm) {
+cache_manager_t *create_cache_manager(size_t memory_limit, double chunk_size_factor, slab_stats_t *stats)
+{
+    unsigned int i,count;
+    cache_manager_t *m;
+
+    // initialize stats
+    stats->mem_limit = memory_limit*1024*1024; // memory_limit is in MB
+    m = malloci(stats, sizeof(cache_manager_t));
+    if (!m) {
         fprintf(stderr, SLAB_INIT_MALLOC_ERR);
+        return NULL;
+    }
+    m->stats = stats;
+    memset(m->hist, 0, sizeof(m->hist));
+
+    // the classes are counted per shard and LRU list, a layout with too many
+    // small sizes is not taken.
+    count = slab_class_count(chunk_size_factor);
+    if (count > SLAB_MAX_CLASSES) {
+        fprintf(stderr, SLAB_INIT_CLASSES_ERR);
         goto err;
     }
 
-    // cache_count is calculated by starting from the MIN_SLAB_CHUNK_SIZE and
-    // multiplying it with chunk_size_factor for every iteration till we reach
-    // SLAB_SIZE. This idea is being used on memcached() and proved to be well
-    // on real-world.
-    // TODO: !!!check below cannot return below 0.
-    cm->cache_count = (unsigned int)floor(logbn(chunk_size_factor,
-                                         SLAB_SIZE/MIN_SLAB_CHUNK_SIZE))-1;
-    slab_stats.cache_count = cm->cache_count;
-    
     // alloc/initialize caches
-    cm->caches = malloci(sizeof(cache_t)*cm->cache_count);
-    if (!cm->caches) {
+    m->caches = malloci(stats, sizeof(cache_t)*count);
+    if (!m->caches) {
         fprintf(stderr, SLAB_INIT_MALLOC_ERR);
         goto err;
     }
-
-    for(i=0,size=MIN_SLAB_CHUNK_SIZE; i < cm->cache_count; size*=chunk_size_factor, i++) {
-        if (size % CHUNK_ALIGN_BYTES) {
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
-        }
-        cm->caches[i].chunk_size = size;
-        cm->caches[i].chunk_count_perslab = SLAB_SIZE / size;
+    m->cache_count = class_sizes(chunk_size_factor, m->caches);
+    for(i=0; i < m->cache_count; i++) {
+        m->caches[i].chunk_count_perslab = SLAB_SIZE / m->caches[i].chunk_size;
     }
+    stats->cache_count = m->cache_count;
 
     // calculate remaining memory for slabs. sizeof(uint64_t) is the bytes
     // allocated at every malloced chunk. Add that, too.
-    cm->slabctl_count = (slab_stats.mem_limit-slab_stats.mem_mallocd-(2*sizeof(uint64_t))) /
+    m->slabctl_count = (stats->mem_limit-stats->mem_mallocd-(2*sizeof(uint64_t))) /
                         (SLAB_SIZE+sizeof(slab_ctl_t));
-    if (cm->slabctl_count <= 1) {        
+    if (m->slabctl_count <= 1) {        
         fprintf(stderr, SLAB_INIT_MALLOC_ERR);
         goto err;
     }
-    slab_stats.slab_count = cm->slabctl_count;
+    stats->slab_count = m->slabctl_count;
     
     // alloc/initialize slab_ctl and slabs
-    cm->slab_ctls = malloci(sizeof(slab_ctl_t)*cm->slabctl_count);
-    if (!cm->slab_ctls) {
+    m->slab_ctls = malloci(stats, sizeof(slab_ctl_t)*m->slabctl_count);
+    if (!m->slab_ctls) {
         fprintf(stderr, SLAB_INIT_MALLOC_ERR);
         goto err;
     }
     // all metadata is shall be allocated here.
-    slab_stats.mem_used_metadata = slab_stats.mem_mallocd;
+    stats->mem_used_metadata = stats->mem_mallocd;
     
-    cm->slabs = malloci(SLAB_SIZE*cm->slabctl_count);
-    if (!cm->slabs) {
+    // no slab is committed, slabs_free is empty until one is freed.
+    if (!map_slabs(m)) {
         fprintf(stderr, SLAB_INIT_MALLOC_ERR);
         goto err;
     }
-    cm->slabs_free.head = cm->slab_ctls;
-    cm->slabs_free.tail = &cm->slab_ctls[cm->slabctl_count-1];
-    prev_slab = NULL;
-    for(i=0; i < cm->slabctl_count; i++) {
-        cm->slab_ctls[i].prev = prev_slab;
-        if (i == cm->slabctl_count-1) {
-            cm->slab_ctls[i].next = NULL;
-        } else {
-            cm->slab_ctls[i].next = &cm->slab_ctls[i+1];
-        }
-        cm->slab_ctls[i].nindex = i;
-        prev_slab = &cm->slab_ctls[i];
-
-        // setbit indicates free slot. so set all.
-        memset(&cm->slab_ctls[i].slots, 0xFF, sizeof(word_t)*WORD_COUNT);
-    }
+    m->nfree = m->slabctl_count;
 
     // mem_alloc shall always be smaller than mem_limit
-    assert(slab_stats.mem_mallocd <= slab_stats.mem_limit);
+    assert(stats->mem_mallocd <= stats->mem_limit);
 
-    return 1;
+    return m;
 err:
-    deinit_cache_manager();
-    return 0;
+    destroy_cache_manager(m);
+    return NULL;
 }
 
-void *scmalloc(size_t size)
+int init_cache_manager(size_t memory_limit, double chunk_size_factor)
+{
+    if (cm != NULL) {
+        fprintf(stderr, SLAB_ALREADY_INIT_ERR);
+        return 0;
+    }
+
+    cm = create_cache_manager(memory_limit, chunk_size_factor, &slab_stats);
+
+    return cm != NULL;
+}
+
+void *cmmalloc(cache_manager_t *m, size_t size)
 {
     unsigned int largest_chunk_size;
     int ffindex;
@@ -425,27 +750,36 @@ void *scmalloc(size_t size)
     void *result;
     slab_ctl_t *cslab;
 
-    assert(cm != NULL);
-    assert(cm->caches != NULL);
+    assert(m != NULL);
+    assert(m->caches != NULL);
 
     //size in bounds?
-    largest_chunk_size = cm->caches[cm->cache_count-1].chunk_size;
+    largest_chunk_size = m->caches[m->cache_count-1].chunk_size;
     if (size > largest_chunk_size) {
         fprintf(stderr, "invalid size.(%lu)\r\n", (unsigned long)size);
         return NULL;
     }
 
+    if (size && (size <= SLAB_HIST_MAX)) {
+        m->hist[(size - 1) / CHUNK_ALIGN_BYTES]++;
+    }
+
     // find relevant cache
-    ccache = size_to_cache(cm->caches, cm->cache_count, size);
+    ccache = size_to_cache(m->caches, m->cache_count, size);
 
     // need to allocate a slab_ctl?
     cslab = peek(&ccache->slabs_partial);
     if (cslab == NULL) {
-        cslab = pop(&cm->slabs_free);
+        cslab = pop(&m->slabs_free);
+        if (cslab == NULL) {
+            cslab = commit_slab(m);
+        }
         if (cslab == NULL) {
             //fprintf(stderr, "no mem available.\r\n");
             return NULL;
         }
+        m->nfree--;
+        ccache->nslabs++;
         push(&ccache->slabs_partial, cslab);
         cslab->cache = ccache;
     }
@@ -456,37 +790,39 @@ void *scmalloc(size_t size)
     ffindex = ff_setbit(&cslab->slots);
     assert(ffindex != -1); // we take cslab from partial, so ffindex should be valid.
     clear_bit(&cslab->slots, ffindex);
+    ccache->nused++;
     if (++cslab->nused == (ccache->chunk_count_perslab)) {
         pop_and_push(&ccache->slabs_partial, &ccache->slabs_full);
     }
 
-    result = (char *)cm->slabs + cslab->nindex * SLAB_SIZE;
+    result = (char *)m->slabs + (size_t)cslab->nindex * SLAB_SIZE;
     result = (char *)result + ccache->chunk_size * ffindex;
 
-    slab_stats.mem_used += ccache->chunk_size;
+    m->stats->mem_used += ccache->chunk_size;
     
-    assert(slab_stats.mem_used <= slab_stats.mem_mallocd);
+    assert(m->stats->mem_used <= m->stats->mem_mallocd);
 
     return result;
 }
 
-void scfree(void *ptr)
+void cmfree(cache_manager_t *m, void *ptr)
 {
     unsigned int sidx, cidx;
-    unsigned int pdiff;
+    size_t pdiff;
     slab_ctl_t *cslab;
-    int res;
+    cache_t *ccache;
+    int was_full;
 
     // ptr shall be in valid memory
-    pdiff = (char *)ptr - (char *)cm->slabs;
-    if (pdiff > (unsigned int)cm->slabctl_count*SLAB_SIZE) {
+    pdiff = (size_t)((char *)ptr - (char *)m->slabs);
+    if (pdiff >= (size_t)m->ncommitted * SLAB_SIZE) {
         fprintf(stderr, "invalid ptr.(%p)\r\n", ptr);
         assert(0 == 1);
         return;
     }
 
-    sidx = pdiff / SLAB_SIZE;
-    cslab = &cm->slab_ctls[sidx];
+    sidx = (unsigned int)(pdiff / SLAB_SIZE);
+    cslab = &m->slab_ctls[sidx];
     cidx = (pdiff % SLAB_SIZE) / cslab->cache->chunk_size;
 
     // check if ptr is really allocated?
@@ -496,23 +832,230 @@ void scfree(void *ptr)
         return;
     }
     set_bit(&cslab->slots, cidx);
+
+    // the usage tells which list owns the slab, so it is unlinked in O(1).
+    // A draining slab is in no list until it is empty.
+    ccache = cslab->cache;
+    ccache->nused--;
+    was_full = (cslab->nused == ccache->chunk_count_perslab);
     if (--cslab->nused == 0) {
-        res = rem_and_push(&cslab->cache->slabs_partial, &cm->slabs_free, cslab);
-        if (!res) {
-            res = rem_and_push(&cslab->cache->slabs_full, &cm->slabs_free, cslab);
+        if (cslab->draining) {
+            push(&m->slabs_free, cslab);
+            cslab->draining = 0;
+        } else {
+            rem_and_push(was_full ? &ccache->slabs_full : &ccache->slabs_partial,
+                         &m->slabs_free, cslab);
+        }
+        m->nfree++;
+        ccache->nslabs--;
+    } else if (was_full && !cslab->draining) {
+        rem_and_push(&ccache->slabs_full, &ccache->slabs_partial, cslab);
+    }
+
+    m->stats->mem_used -= ccache->chunk_size;
+}
+
+// index of the cache that serves the size, -1 if no cache does. Memory of one
+// cache is only reusable by allocations of the same cache.
+int cmclass(cache_manager_t *m, size_t size)
+{
+    cache_t *ccache;
+
+    ccache = size_to_cache(m->caches, m->cache_count, size);
+    if (!ccache) {
+        return -1;
+    }
+    return (int)(ccache - m->caches);
+}
+
+// whether size can be allocated without taking one of the last reserve free
+// slabs. A size whose cache has a partial slab does not need a free slab.
+int cmhas_room(cache_manager_t *m, size_t size, unsigned int reserve)
+{
+    cache_t *ccache;
+
+    ccache = size_to_cache(m->caches, m->cache_count, size);
+    if (!ccache) {
+        return 0;
+    }
+    return (peek(&ccache->slabs_partial) != NULL) || (m->nfree > reserve);
+}
+
+// slabs assigned to the cache of a class.
+unsigned int cmslabs(cache_manager_t *m, int cls)
+{
+    if ((cls < 0) || ((unsigned int)cls >= m->cache_count)) {
+        return 0;
+    }
+    return m->caches[cls].nslabs;
+}
+
+// chunk usage of the slabs of a class. The free chunks of its slabs are only
+// usable by the class, many of them means that the class is fragmented.
+int cmclass_stats(cache_manager_t *m, int cls, slab_class_stats_t *cs)
+{
+    cache_t *ccache;
+
+    if ((cls < 0) || ((unsigned int)cls >= m->cache_count)) {
+        return 0;
+    }
+    ccache = &m->caches[cls];
+    cs->chunk_size = ccache->chunk_size;
+    cs->chunks_perslab = ccache->chunk_count_perslab;
+    cs->slabs = ccache->nslabs;
+    cs->chunks_used = ccache->nused;
+    cs->chunks_free = ccache->nslabs * ccache->chunk_count_perslab - ccache->nused;
+    return 1;
+}
+
+// adds the requests counted per size to hist. Bucket i counts the sizes up to
+// (i+1)*CHUNK_ALIGN_BYTES, larger than the one of bucket i-1.
+void cmsize_hist(cache_manager_t *m, uint64_t *hist)
+{
+    unsigned int i;
+
+    for(i=0; i<SLAB_HIST_BUCKETS; i++) {
+        hist[i] += m->hist[i];
+    }
+}
+
+// Slab re-assignment: takes a slab of the class out of its cache, so that no
+// more chunks are allocated from it. The caller frees its chunks, then the
+// slab goes to the free slabs to be taken by any cache. The least used slab
+// is picked, it has the fewest chunks to free. Returns the slab, -1 if the
+// class has none.
+int cmdrain(cache_manager_t *m, int cls)
+{
+    cache_t *ccache;
+    slab_ctl_t *cslab, *s;
+
+    if ((cls < 0) || ((unsigned int)cls >= m->cache_count)) {
+        return -1;
+    }
+    ccache = &m->caches[cls];
+    cslab = NULL;
+    for(s=peek(&ccache->slabs_partial); s!=NULL; s=s->next) {
+        if (!cslab || (s->nused < cslab->nused)) {
+            cslab = s;
+        }
+    }
+    if (cslab) {
+        rem(&ccache->slabs_partial, cslab);
+    } else {
+        cslab = peek(&ccache->slabs_full);
+        if (!cslab) {
+            return -1;
+        }
+        rem(&ccache->slabs_full, cslab);
+    }
+    cslab->next = cslab->prev = NULL;
+    cslab->draining = 1;
+
+    return (int)cslab->nindex;
+}
+
+// the first allocated chunk of a draining slab from *idx on, NULL if there is
+// none left or the slab is not draining anymore. *idx is moved past it and
+// *size is set to the chunk size.
+void *cmdrain_chunk(cache_manager_t *m, int slab, unsigned int *idx, size_t *size)
+{
+    slab_ctl_t *cslab;
+    cache_t *ccache;
+
+    assert((slab >= 0) && ((unsigned int)slab < m->slabctl_count));
+
+    cslab = &m->slab_ctls[slab];
+    if (!cslab->draining) {
+        return NULL;
+    }
+    ccache = cslab->cache;
+    for(; *idx < ccache->chunk_count_perslab; (*idx)++) {
+        if (!get_bit(&cslab->slots, *idx)) {
+            *size = ccache->chunk_size;
+            return (char *)m->slabs + (size_t)cslab->nindex * SLAB_SIZE + ccache->chunk_size * (*idx)++;
         }
-        assert(res == 1); // somebody must own the slab.
-    } else if (cslab->nused == cslab->cache->chunk_count_perslab-1) {
-        res = rem_and_push(&cslab->cache->slabs_full, &cslab->cache->slabs_partial, cslab);
-        assert(res == 1); // slabs_full must own the slab.
+    }
+    return NULL;
+}
+
+// gives a draining slab that could not be emptied back to its cache.
+void cmundrain(cache_manager_t *m, int slab)
+{
+    slab_ctl_t *cslab;
+    cache_t *ccache;
+
+    assert((slab >= 0) && ((unsigned int)slab < m->slabctl_count));
+
+    cslab = &m->slab_ctls[slab];
+    if (!cslab->draining) {
+        return; // emptied meanwhile
+    }
+    ccache = cslab->cache;
+    cslab->draining = 0;
+    if (cslab->nused == ccache->chunk_count_perslab) {
+        push(&ccache->slabs_full, cslab);
     } else {
-        // TODO: move closer to head for efficiency?
+        push(&ccache->slabs_partial, cslab);
     }
+}
 
-    slab_stats.mem_used -= cslab->cache->chunk_size;
+void *scmalloc(size_t size)
+{
+    return cmmalloc(cm, size);
+}
+
+void scfree(void *ptr)
+{
+    cmfree(cm, ptr);
+}
+
+int scclass(size_t size)
+{
+    return cmclass(cm, size);
+}
+
+int schas_room(size_t size, unsigned int reserve)
+{
+    return cmhas_room(cm, size, reserve);
+}
+
+int scclass_stats(int cls, slab_class_stats_t *cs)
+{
+    return cmclass_stats(cm, cls, cs);
+}
+
+void scsize_hist(uint64_t *hist)
+{
+    cmsize_hist(cm, hist);
+}
+
+unsigned int scslabs(int cls)
+{
+    return cmslabs(cm, cls);
+}
+
+int scdrain(int cls)
+{
+    return cmdrain(cm, cls);
+}
+
+void *scdrain_chunk(int slab, unsigned int *idx, size_t *size)
+{
+    return cmdrain_chunk(cm, slab, idx, size);
+}
+
+void scundrain(int slab)
+{
+    cmundrain(cm, slab);
 }
 
 #ifdef LC_TEST
+static void deinit_cache_manager(void)
+{
+    destroy_cache_manager(cm);
+    cm = NULL;
+}
+
 void test_bit_set(void)
 {
     bitset_t *y;
@@ -574,6 +1117,22 @@ void test_bit_set(void)
     clear_bit(y, 97);
     assert(ff_setbit(y) == 104);
 
+    // summaries follow the words, the farthest bits are found, too.
+    memset(y, 0x00 ,sizeof(bitset_t));
+    set_bit(y, WORD_COUNT*WORD_SIZE_IN_BITS - 1);
+    set_bit(y, 64*64 + 3);
+    assert(ff_setbit(y) == 64*64 + 3);
+    clear_bit(y, 64*64 + 3);
+    assert(ff_setbit(y) == (int)(WORD_COUNT*WORD_SIZE_IN_BITS - 1));
+    clear_bit(y, WORD_COUNT*WORD_SIZE_IN_BITS - 1);
+    assert(ff_setbit(y) == -1);
+    assert(y->top == 0);
+    fill_bits(y);
+    assert(ff_setbit(y) == 0);
+    clear_bit(y, 0);
+    assert(ff_setbit(y) == 1);
+    free(y);
+
 }
 
 void test_size_to_cache(void)
@@ -695,4 +1254,320 @@ void test_slab_allocator(void)
     assert(p == NULL);
 }
 
+void test_arenas(void)
+{
+    slab_stats_t s1, s2;
+    cache_manager_t *m1, *m2;
+    cache_t *cc;
+    void *p, **ptrs;
+    unsigned int i, count, nfree;
+
+    memset(&s1, 0, sizeof(s1));
+    memset(&s2, 0, sizeof(s2));
+    m1 = create_cache_manager(100, 1.25, &s1);
+    m2 = create_cache_manager(100, 1.25, &s2);
+    assert(m1 != NULL && m2 != NULL);
+
+    // an arena only accounts for its own chunks.
+    p = cmmalloc(m1, 50);
+    assert(p != NULL);
+    assert(s1.mem_used != 0);
+    assert(s2.mem_used == 0);
+    cmfree(m1, p);
+    assert(s1.mem_used == 0);
+
+    // sizes of the same cache share a class.
+    assert(cmclass(m1, 1) == 0);
+    assert(cmclass(m1, 999) == cmclass(m1, 1000));
+    assert(cmclass(m1, 1000) < cmclass(m1, 4000));
+    assert(cmclass(m1, SLAB_SIZE+1) == -1);
+
+    // exhausting an arena does not affect the other one.
+    assert(cmhas_room(m1, 1000, s1.slab_count-1));
+    assert(!cmhas_room(m1, 1000, s1.slab_count));
+    while(cmmalloc(m1, 1000) != NULL) {
+    }
+    assert(cmmalloc(m1, 1000) == NULL);
+    assert(!cmhas_room(m1, 1000, 0));
+    assert(cmmalloc(m2, 1000) != NULL);
+    assert(cmhas_room(m2, 1000, s2.slab_count)); // a partial slab is enough
+
+    // a slab in the middle of the full list goes to partial, then to free.
+    cc = &m2->caches[cmclass(m2, 1000)];
+    count = cc->chunk_count_perslab;
+    nfree = m2->nfree;
+    ptrs = malloc(3 * count * sizeof(void *));
+    for(i=1; i<3*count; i++) {
+        ptrs[i] = cmmalloc(m2, 1000);
+        assert(ptrs[i] != NULL);
+    }
+    assert(cc->slabs_partial.head == NULL);
+    assert(m2->nfree == nfree - 2);
+    cmfree(m2, ptrs[count+5]);
+    assert(cc->slabs_partial.head != NULL);
+    assert(cc->slabs_partial.head == cc->slabs_partial.tail);
+    assert(cmmalloc(m2, 1000) == ptrs[count+5]);
+    for(i=count; i<2*count; i++) {
+        cmfree(m2, ptrs[i]);
+    }
+    assert(cc->slabs_partial.head == NULL);
+    assert(m2->nfree == nfree - 1);
+    for(i=1; i<count; i++) {
+        cmfree(m2, ptrs[i]);
+    }
+    for(i=2*count; i<3*count; i++) {
+        cmfree(m2, ptrs[i]);
+    }
+    assert(cc->slabs_full.head == NULL);
+    assert(cc->slabs_partial.head != NULL); // the chunk allocated above
+    free(ptrs);
+
+    destroy_cache_manager(m1);
+    destroy_cache_manager(m2);
+    assert(s1.mem_mallocd == 0);
+    assert(s2.mem_mallocd == 0);
+}
+
+void test_drain(void)
+{
+    slab_stats_t s;
+    cache_manager_t *m;
+    void *p, *chunk, **ptrs;
+    unsigned int i, n, idx, count, nfree;
+    size_t size;
+    int slab, cls;
+    slab_class_stats_t cs;
+
+    memset(&s, 0, sizeof(s));
+    m = create_cache_manager(10, 1.25, &s);
+    assert(m != NULL);
+    cls = cmclass(m, 1000);
+    assert(cmdrain(m, cls) == -1); // no slabs
+    assert(cmdrain(m, -1) == -1);
+
+    // all slabs to a single class.
+    count = m->caches[cls].chunk_count_perslab;
+    ptrs = malloc(m->slabctl_count * count * sizeof(void *));
+    n = 0;
+    while((p = cmmalloc(m, 1000)) != NULL) {
+        ptrs[n++] = p;
+    }
+    assert(n == m->slabctl_count * count);
+    assert(cmslabs(m, cls) == m->slabctl_count);
+    assert(cmmalloc(m, 100) == NULL);
+
+    // the least used slab is drained, nothing is allocated from it.
+    cmfree(m, ptrs[count+1]);
+    cmfree(m, ptrs[count+2]);
+    cmfree(m, ptrs[3*count]);
+    assert(cmclass_stats(m, cls, &cs));
+    assert(cs.slabs == m->slabctl_count);
+    assert(cs.chunks_used == n - 3);
+    assert(cs.chunks_free == 3);
+    assert(!cmclass_stats(m, m->cache_count, &cs));
+    slab = cmdrain(m, cls);
+    assert(slab == (int)((char *)ptrs[count] - (char *)m->slabs) / SLAB_SIZE);
+    assert(cmmalloc(m, 1000) == ptrs[3*count]);
+    assert(cmmalloc(m, 1000) == NULL);
+
+    // its chunks are found, then it is free for any class.
+    idx = 0;
+    for(i=0; (chunk = cmdrain_chunk(m, slab, &idx, &size)) != NULL; i++) {
+        assert(size == m->caches[cls].chunk_size);
+        assert(chunk != ptrs[count+1] && chunk != ptrs[count+2]);
+        cmfree(m, chunk);
+    }
+    assert(i == count - 2);
+    assert(cmdrain_chunk(m, slab, &idx, &size) == NULL);
+    assert(cmslabs(m, cls) == m->slabctl_count - 1);
+    assert(m->nfree == 1);
+    assert(cmclass_stats(m, cls, &cs));
+    assert(cs.chunks_used == n - count);
+    assert(cs.chunks_free == 0);
+    assert(cmmalloc(m, 100) != NULL);
+    assert(cmslabs(m, cmclass(m, 100)) == 1);
+
+    // a slab given back is used again.
+    slab = cmdrain(m, cls);
+    assert(slab != -1);
+    nfree = m->nfree;
+    cmfree(m, (char *)m->slabs + slab * SLAB_SIZE);
+    cmundrain(m, slab);
+    assert(m->nfree == nfree);
+    assert(cmmalloc(m, 1000) == (char *)m->slabs + slab * SLAB_SIZE);
+
+    free(ptrs);
+    destroy_cache_manager(m);
+    assert(s.mem_mallocd == 0);
+}
+
+// waste of serving the requests in hist with the ascending sizes.
+static uint64_t layout_waste(const uint64_t *hist, const unsigned int *sizes, unsigned int count)
+{
+    unsigned int b, j, size;
+    uint64_t waste;
+
+    waste = 0;
+    j = 0;
+    for(b=0; b<SLAB_HIST_BUCKETS; b++) {
+        size = (b + 1) * CHUNK_ALIGN_BYTES;
+        while (j < count && sizes[j] < size) {
+            j++;
+        }
+        if (hist[b]) {
+            assert(j < count);
+            waste += hist[b] * (sizes[j] - size);
+        }
+    }
+    return waste;
+}
+
+void test_layout(void)
+{
+    uint64_t *hist, best, waste;
+    unsigned int sizes[SLAB_MAX_LAYOUT], all[SLAB_MAX_LAYOUT], largest;
+    unsigned int i, b, n, mask, minb, count, round;
+    slab_stats_t s;
+    cache_manager_t *m;
+
+    memset(&s, 0, sizeof(s));
+    m = create_cache_manager(10, 1.25, &s);
+    assert(m != NULL);
+    largest = m->caches[m->cache_count-1].chunk_size;
+    destroy_cache_manager(m);
+
+    hist = calloc(SLAB_HIST_BUCKETS, sizeof(uint64_t));
+    assert(slab_layout(hist, 4, sizes) == 0);
+
+    // few sizes get a chunk size each, tiny ones the smallest chunk size.
+    hist[(8-1)/CHUNK_ALIGN_BYTES] = 1;
+    hist[(100-1)/CHUNK_ALIGN_BYTES] = 10;
+    hist[(1000-1)/CHUNK_ALIGN_BYTES] = 5;
+    assert(slab_layout(hist, 4, sizes) == 3);
+    assert(sizes[0] == 24 && sizes[1] == 104 && sizes[2] == 1000);
+
+    // with fewer, the rare sizes are served by the chunk size of larger ones.
+    hist[(200-1)/CHUNK_ALIGN_BYTES] = 1000;
+    assert(slab_layout(hist, 3, sizes) == 3);
+    assert(sizes[0] == 104 && sizes[1] == 200 && sizes[2] == 1000);
+    assert(slab_layout(hist, 2, sizes) == 2);
+    assert(sizes[0] == 200 && sizes[1] == 1000);
+
+    // a layout replaces the small chunk sizes of the new arenas.
+    assert(slab_set_layout(sizes, 2));
+    memset(&s, 0, sizeof(s));
+    m = create_cache_manager(10, 1.25, &s);
+    assert(m != NULL);
+    assert(m->caches[0].chunk_size == 200);
+    assert(m->caches[1].chunk_size == 1000);
+    assert(m->caches[2].chunk_size == 1184);
+    assert(m->caches[m->cache_count-1].chunk_size == largest);
+    assert(cmclass(m, 150) == 0);
+
+    // the layout found wastes as little as the best of all the layouts.
+    minb = (align_chunk(MIN_SLAB_CHUNK_SIZE) - 1) / CHUNK_ALIGN_BYTES;
+    srand(1);
+    for(round=0; round<20; round++) {
+        memset(hist, 0, SLAB_HIST_BUCKETS * sizeof(uint64_t));
+        n = 12;
+        for(i=0; i<n; i++) {
+            b = minb + i * 5 + rand() % 5;
+            hist[b] = 1 + rand() % (round < 10 ? 3 : 1000);
+            all[i] = (b + 1) * CHUNK_ALIGN_BYTES;
+        }
+        count = 1 + round % 5;
+        best = UINT64_MAX;
+        for(mask=0; mask<(1u << (n-1)); mask++) {
+            // the largest size always serves the last bucket.
+            for(i=0, b=0; i<n-1; i++) {
+                if (mask & (1u << i)) {
+                    sizes[b++] = all[i];
+                }
+            }
+            if (b >= count) {
+                continue;
+            }
+            sizes[b++] = all[n-1];
+            waste = layout_waste(hist, sizes, b);
+            if (waste < best) {
+                best = waste;
+            }
+        }
+        assert(slab_layout(hist, count, sizes) == count);
+        assert(layout_waste(hist, sizes, count) == best);
+    }
+
+    // requests are counted per size.
+    cmfree(m, cmmalloc(m, 150));
+    cmfree(m, cmmalloc(m, SLAB_HIST_MAX + 1)); // not counted
+    memset(hist, 0, SLAB_HIST_BUCKETS * sizeof(uint64_t));
+    cmsize_hist(m, hist);
+    assert(hist[(150-1)/CHUNK_ALIGN_BYTES] == 1);
+    assert(hist[(144-1)/CHUNK_ALIGN_BYTES] == 0);
+    destroy_cache_manager(m);
+
+    sizes[0] = 2000;
+    assert(!slab_set_layout(sizes, 2)); // not ascending
+    sizes[0] = SLAB_SIZE + 1;
+    assert(!slab_set_layout(sizes, 1));
+
+    // many small sizes leave more classes than an arena has.
+    for(i=0; i<SLAB_MAX_LAYOUT; i++) {
+        sizes[i] = 24 + i * CHUNK_ALIGN_BYTES;
+    }
+    assert(slab_set_layout(sizes, SLAB_MAX_LAYOUT));
+    assert(slab_class_count(1.25) > SLAB_MAX_CLASSES);
+    memset(&s, 0, sizeof(s));
+    assert(create_cache_manager(10, 1.25, &s) == NULL);
+    assert(slab_set_layout(NULL, 0));
+    assert(slab_class_count(1.25) <= SLAB_MAX_CLASSES);
+    free(hist);
+}
+
+void test_commit(void)
+{
+    slab_stats_t s;
+    cache_manager_t *m;
+    void *p, **ptrs;
+    unsigned int i, count;
+
+    // slabs are reserved, not committed, even for arenas over 4GB.
+    memset(&s, 0, sizeof(s));
+    m = create_cache_manager(5*1024, 1.25, &s);
+    assert(m != NULL);
+    assert(!cmbind(m, -1));
+    cmbind(m, 0); // fails without NUMA support, slabs are still committed
+    assert((uint64_t)m->slabctl_count * SLAB_SIZE > UINT_MAX);
+    assert(s.mem_committed == 0);
+    assert(m->nfree == m->slabctl_count);
+    assert(((uintptr_t)m->slabs % SLAB_HUGE_PAGE_SIZE) == 0);
+
+    // one by one, when the free ones run out.
+    count = m->caches[cmclass(m, 1000)].chunk_count_perslab;
+    ptrs = malloc(2 * count * sizeof(void *));
+    for(i=0; i<2*count; i++) {
+        ptrs[i] = cmmalloc(m, 1000);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], 0xFF, 1000);
+    }
+    assert(s.mem_committed == 2 * SLAB_SIZE);
+    assert(m->nfree == m->slabctl_count - 2);
+    p = cmmalloc(m, 50);
+    assert(s.mem_committed == 3 * SLAB_SIZE);
+    cmfree(m, p);
+    for(i=0; i<2*count; i++) {
+        cmfree(m, ptrs[i]);
+    }
+    assert(m->nfree == m->slabctl_count);
+
+    // freed slabs are used again first.
+    p = cmmalloc(m, 4000);
+    assert(p != NULL);
+    assert(s.mem_committed == 3 * SLAB_SIZE);
+    cmfree(m, p);
+    free(ptrs);
+    destroy_cache_manager(m);
+    assert(s.mem_mallocd == 0);
+}
+
 #endif
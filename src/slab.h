@@ -3,17 +3,18 @@
 A General purpose Slab Allocator
 
   - Size ranges can be changed at compile time.
-  - Slab re-assignment is possible.
+  - Slab re-assignment is possible. A slab is taken out of its
+    size class with cmdrain(), and once its chunks are freed
+    it can be used by any class.
   - Every bit is pre-allocated as continuous buffers. 
-    So, assuming good CPU cache locality.
-  - free() is an O(1) operation whereas malloc() is 
-    O(N). O(N) comes from the searching of the first set bit
-    in a word array where N is roughly equals to 
-    SLAB_SIZE / MIN_SLAB_CHUNK_SIZE. Theoretically, the runtime 
-    O(N) behavior can be reduced to O(logN) by using a heap instead
-    of a plain array with an increase of some additional memory.
-    However, from practical point of view, this will degrade runtime
-    performance as the number of N is very small.
+    So, assuming good CPU cache locality. The slabs are
+    reserved with mmap() and committed one by one when the
+    free slabs run out, on huge pages if possible.
+  - malloc() and free() are O(1) operations. The free chunks
+    of a slab are bits in a word array with two levels of
+    summary words above it, so the first free chunk is found
+    with three bit scans. Slabs are unlinked from their lists
+    in O(1), too.
 
 Sumer Cip 2011
 
@@ -28,26 +29,80 @@ Sumer Cip 2011
 #define SLAB_SIZE (1024*1024)
 #define MIN_SLAB_CHUNK_SIZE (20)
 #define CHUNK_ALIGN_BYTES (8)
+#define SLAB_HUGE_PAGE_SIZE (2*1024*1024) /* slabs start at a huge page boundary */
+#define SLAB_HIST_BUCKETS (1024) /* allocation sizes are counted per CHUNK_ALIGN_BYTES up to SLAB_HIST_MAX */
+#define SLAB_HIST_MAX (SLAB_HIST_BUCKETS*CHUNK_ALIGN_BYTES)
+#define SLAB_MAX_LAYOUT (64) /* max. chunk sizes of a layout */
+#define SLAB_MAX_CLASSES (64) /* max. size classes of an arena, with the layout */
 
 typedef struct slab_stats_t {
     uint64_t mem_used;
     uint64_t mem_mallocd;
     uint64_t mem_limit;
     uint64_t mem_used_metadata;
+    uint64_t mem_committed; /* slabs taken from the system so far */
     unsigned int cache_count;
     unsigned int slab_count;
 } slab_stats_t;
 
+typedef struct slab_class_stats_t {
+    unsigned int chunk_size;
+    unsigned int chunks_perslab;
+    unsigned int slabs;
+    unsigned int chunks_used;
+    unsigned int chunks_free; /* in the slabs of the class */
+} slab_class_stats_t;
+
+typedef struct cache_manager_t cache_manager_t;
+
 extern slab_stats_t slab_stats;
 
+/* chunk sizes of the arenas created from then on, up to the largest one of the
+ * layout. Larger chunks keep the sizes from the chunk_size_factor. */
+int slab_set_layout(const unsigned int *sizes, unsigned int count);
+/* size classes of the arenas created from then on, see slab_set_layout(). */
+unsigned int slab_class_count(double chunk_size_factor);
+unsigned int slab_layout(const uint64_t *hist, unsigned int count, unsigned int *sizes);
+/* slabs of the arenas created from then on are on explicit huge pages
+ * (hugetlbfs), if the system has enough of them reserved. */
+void slab_set_hugetlb(int on);
+
+/* independent arenas, every arena accounts into the stats it is given. */
+cache_manager_t *create_cache_manager(size_t memory_limit, double chunk_size_factor, slab_stats_t *stats);
+void destroy_cache_manager(cache_manager_t *m);
+void *cmmalloc(cache_manager_t *m, size_t size);
+void cmfree(cache_manager_t *m, void *ptr);
+int cmclass(cache_manager_t *m, size_t size);
+int cmhas_room(cache_manager_t *m, size_t size, unsigned int reserve);
+int cmbind(cache_manager_t *m, int node);
+int cmclass_stats(cache_manager_t *m, int cls, slab_class_stats_t *cs);
+void cmsize_hist(cache_manager_t *m, uint64_t *hist);
+unsigned int cmslabs(cache_manager_t *m, int cls);
+int cmdrain(cache_manager_t *m, int cls);
+void *cmdrain_chunk(cache_manager_t *m, int slab, unsigned int *idx, size_t *size);
+void cmundrain(cache_manager_t *m, int slab);
+
+/* the default arena, accounted in slab_stats. */
 int init_cache_manager(size_t memory_limit, double chunk_size_factor);
 void *scmalloc(size_t size);
 void scfree(void *ptr);
+int scclass(size_t size);
+int schas_room(size_t size, unsigned int reserve);
+int scclass_stats(int cls, slab_class_stats_t *cs);
+void scsize_hist(uint64_t *hist);
+unsigned int scslabs(int cls);
+int scdrain(int cls);
+void *scdrain_chunk(int slab, unsigned int *idx, size_t *size);
+void scundrain(int slab);
 
 #ifdef LC_TEST
 void test_slab_allocator(void);
 void test_size_to_cache(void);
 void test_bit_set(void);
+void test_arenas(void);
+void test_drain(void);
+void test_layout(void);
+void test_commit(void);
 #endif
 
 #endif
@@ -0,0 +1,576 @@
+/*
+*    Open addressing hash table engine, see hashtab.c
+*
+*    Swiss table style: every slot has a control byte holding 7 bits of the
+*    hash of its key, or marking it empty or deleted. A lookup compares a
+*    group of HGROUP_SIZE control bytes with a single SSE2 instruction and
+*    only visits the slots whose tag matches, the slots store the full hash
+*    and the key pointer inline. So a GET touches a control group and usually
+*    a single slot instead of walking a list of separately allocated nodes,
+*    and a miss mostly ends in the control group without touching any slot.
+*
+*    Resizing is incremental like in the chained engine: a resized slot array
+*    becomes the current one and the groups of the previous array are moved
+*    into it a few at a time by the following operations. Deleted slots are
+*    dropped on the way, so a table full of them is resized to the same size.
+*/
+
+#ifdef __SSE2__
+#include "emmintrin.h"
+#endif
+
+#define HCTRL_EMPTY ((signed char)-128)
+#define HCTRL_DELETED ((signed char)-2)
+#define H1(h) ((unsigned int)((h) >> 7))
+#define H2(h) ((signed char)((h) & 0x7F))
+
+// bit i is set when slot i of the group matches.
+static unsigned int _hmatch(signed char *ctrl, signed char tag)
+{
+#ifdef __SSE2__
+    __m128i group;
+
+    group = _mm_loadu_si128((__m128i *)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    int i;
+    unsigned int m;
+
+    for(m=0, i=0; i<HGROUP_SIZE; i++) {
+        if (ctrl[i] == tag) {
+            m |= 1U << i;
+        }
+    }
+    return m;
+#endif
+}
+
+// empty and deleted control bytes are the negative ones.
+static unsigned int _hmatch_free(signed char *ctrl)
+{
+#ifdef __SSE2__
+    return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((__m128i *)ctrl));
+#else
+    int i;
+    unsigned int m;
+
+    for(m=0, i=0; i<HGROUP_SIZE; i++) {
+        if (ctrl[i] < 0) {
+            m |= 1U << i;
+        }
+    }
+    return m;
+#endif
+}
+
+static int _hinit(_hslots *s, int logsize)
+{
+    s->realsize = HSIZE(logsize);
+    if (s->realsize < HGROUP_SIZE) {
+        s->realsize = HGROUP_SIZE;
+    }
+    s->mask = s->realsize / HGROUP_SIZE - 1;
+    s->count = 0;
+    s->deleted = 0;
+    s->ctrl = (signed char *)li_malloc(s->realsize);
+    if (!s->ctrl) {
+        return 0;
+    }
+    s->slots = (_hitem *)li_malloc(s->realsize * sizeof(_hitem));
+    if (!s->slots) {
+        li_free(s->ctrl);
+        s->ctrl = NULL;
+        return 0;
+    }
+    memset(s->ctrl, HCTRL_EMPTY, s->realsize);
+    return 1;
+}
+
+static void _hdeinit(_hslots *s)
+{
+    li_free(s->ctrl);
+    li_free(s->slots);
+    memset(s, 0, sizeof(_hslots));
+}
+
+// groups are probed in triangular steps, which visits every group of a power
+// of two sized array once.
+static _hitem *_hlookup(_hslots *s, uint64_t h, char *key, int klen)
+{
+    unsigned int g, i, m;
+    signed char *ctrl;
+    _hitem *it;
+
+    g = H1(h) & s->mask;
+    for(i=0; i<=(unsigned int)s->mask; i++) {
+        ctrl = &s->ctrl[g*HGROUP_SIZE];
+        m = _hmatch(ctrl, H2(h));
+        while(m) {
+            it = &s->slots[g*HGROUP_SIZE + __builtin_ctz(m)];
+            if ((it->hash == h) && (it->klen == klen) && (memcmp(it->key, key, klen) == 0)) {
+                return it;
+            }
+            m &= m - 1;
+        }
+        if (_hmatch(ctrl, HCTRL_EMPTY)) {
+            return NULL;
+        }
+        g = (g + i + 1) & s->mask;
+    }
+    return NULL;
+}
+
+static _hitem *_hlookupval(_hslots *s, uint64_t h, void *val)
+{
+    unsigned int g, i, m;
+    signed char *ctrl;
+    _hitem *it;
+
+    g = H1(h) & s->mask;
+    for(i=0; i<=(unsigned int)s->mask; i++) {
+        ctrl = &s->ctrl[g*HGROUP_SIZE];
+        m = _hmatch(ctrl, H2(h));
+        while(m) {
+            it = &s->slots[g*HGROUP_SIZE + __builtin_ctz(m)];
+            if ((it->hash == h) && (it->val == val)) {
+                return it;
+            }
+            m &= m - 1;
+        }
+        if (_hmatch(ctrl, HCTRL_EMPTY)) {
+            return NULL;
+        }
+        g = (g + i + 1) & s->mask;
+    }
+    return NULL;
+}
+
+// takes the first empty or deleted slot on the probe sequence of h.
+static _hitem *_htake(_hslots *s, uint64_t h)
+{
+    unsigned int g, i, m, idx;
+
+    g = H1(h) & s->mask;
+    for(i=0; i<=(unsigned int)s->mask; i++) {
+        m = _hmatch_free(&s->ctrl[g*HGROUP_SIZE]);
+        if (m) {
+            idx = g*HGROUP_SIZE + __builtin_ctz(m);
+            if (s->ctrl[idx] == HCTRL_DELETED) {
+                s->deleted--;
+            }
+            s->ctrl[idx] = H2(h);
+            s->count++;
+            return &s->slots[idx];
+        }
+        g = (g + i + 1) & s->mask;
+    }
+    return NULL;
+}
+
+// a slot can become empty again if its group still has an empty slot: probes
+// stop at such a group, so none of them continues past it.
+static void _hrelease(_hslots *s, int idx)
+{
+    if (_hmatch(&s->ctrl[idx - idx % HGROUP_SIZE], HCTRL_EMPTY)) {
+        s->ctrl[idx] = HCTRL_EMPTY;
+    } else {
+        s->ctrl[idx] = HCTRL_DELETED;
+        s->deleted++;
+    }
+    s->count--;
+}
+
+static void _hrehash_step(_htab *ht)
+{
+    int n, j, idx;
+    _hitem *it;
+
+    if (ht->rehashidx == -1) {
+        return;
+    }
+
+    for(n=0; n<HREHASH_STEP && ht->rehashidx<=ht->old.mask; n++, ht->rehashidx++) {
+        for(j=0; j<HGROUP_SIZE; j++) {
+            idx = ht->rehashidx*HGROUP_SIZE + j;
+            if (ht->old.ctrl[idx] < 0) {
+                continue;
+            }
+            it = _htake(&ht->t, ht->old.slots[idx].hash);
+            assert(it != NULL); // the new slots are sized for all items.
+            *it = ht->old.slots[idx];
+            ht->old.ctrl[idx] = HCTRL_DELETED;
+            ht->old.count--;
+        }
+    }
+
+    if (ht->rehashidx > ht->old.mask) {
+        assert(ht->old.count == 0);
+        _hdeinit(&ht->old);
+        ht->rehashidx = -1;
+    }
+}
+
+static int _hresize(_htab *ht, int logsize)
+{
+    _hslots s;
+
+    while(ht->rehashidx != -1) {
+        _hrehash_step(ht);
+    }
+
+    if (!_hinit(&s, logsize)) {
+        return 0;
+    }
+    ht->old = ht->t;
+    ht->t = s;
+    ht->logsize = logsize;
+    ht->rehashidx = 0;
+    ht->capped = 0;
+    return 1;
+}
+
+// drops the deleted slots in place, when the slots cannot be resized. All full
+// slots are marked deleted and re-placed one by one at the first free slot of
+// their probe sequence, swapping with one not re-placed yet if needed. A slot
+// stays if that is its own group: lookups scan the whole group.
+static void _hdrop_deleted(_hslots *s)
+{
+    int i, idx;
+    unsigned int g, j, m;
+    _hitem tmp;
+
+    for(i=0; i<s->realsize; i++) {
+        s->ctrl[i] = (s->ctrl[i] >= 0) ? HCTRL_DELETED : HCTRL_EMPTY;
+    }
+    s->deleted = 0;
+
+    for(i=0; i<s->realsize; i++) {
+        while(s->ctrl[i] == HCTRL_DELETED) {
+            g = H1(s->slots[i].hash) & s->mask;
+            for(j=0; !(m = _hmatch_free(&s->ctrl[g*HGROUP_SIZE])); j++) {
+                g = (g + j + 1) & s->mask;
+            }
+            if (g == (unsigned int)(i / HGROUP_SIZE)) {
+                s->ctrl[i] = H2(s->slots[i].hash);
+                break;
+            }
+            idx = g*HGROUP_SIZE + __builtin_ctz(m);
+            tmp = s->slots[idx];
+            s->slots[idx] = s->slots[i];
+            s->slots[i] = tmp;
+            if (s->ctrl[idx] == HCTRL_EMPTY) {
+                s->ctrl[i] = HCTRL_EMPTY;
+            } // else the swapped one is re-placed next
+            s->ctrl[idx] = H2(s->slots[idx].hash);
+        }
+    }
+}
+
+// the table is only reorganized by hget() and hset(). A mostly empty table is
+// halved, and deleted slots are dropped once they outnumber the full ones.
+static void _hstep(_htab *ht)
+{
+    if (ht->rehashidx != -1) {
+        _hrehash_step(ht);
+        return;
+    }
+    if ((ht->logsize > ht->minlogsize) &&
+            (ht->t.count < ht->t.realsize * HLOADFACTOR / HSHRINK_RATIO)) {
+        _hresize(ht, ht->logsize-1);
+    } else if ((ht->t.deleted > HGROUP_SIZE) && (ht->t.deleted > ht->t.count)) {
+        if (!_hresize(ht, ht->logsize)) {
+            _hdrop_deleted(&ht->t);
+        }
+    }
+}
+
+_htab *htcreate(int logsize)
+{
+    _htab *ht;
+
+    ht = (_htab *)li_malloc(sizeof(_htab));
+    if (!ht)
+        return NULL;
+    memset(ht, 0, sizeof(_htab));
+    if (!_hinit(&ht->t, logsize)) {
+        li_free(ht);
+        return NULL;
+    }
+    ht->logsize = logsize;
+    ht->minlogsize = logsize;
+    ht->rehashidx = -1;
+
+    return ht;
+}
+
+// val should be freed with henum(...), because obviously we cannot know if it
+// contains other pointers, too.
+void htdestroy(_htab *ht)
+{
+    if (ht->rehashidx != -1) {
+        _hdeinit(&ht->old);
+    }
+    _hdeinit(&ht->t);
+    li_free(ht);
+}
+
+hresult hset(_htab *ht, char* key, int klen, uint64_t h, void *val)
+{
+    _hitem *it;
+    int logsize;
+
+    _hstep(ht);
+
+    if (_hlookup(&ht->t, h, key, klen)) {
+        return HEXISTS;
+    }
+    if ((ht->rehashidx != -1) && _hlookup(&ht->old, h, key, klen)) {
+        return HEXISTS;
+    }
+
+    // need resizing? The slots are doubled, or only the deleted ones dropped
+    // if they are the reason the table is full. Items still to be migrated
+    // count, too: a shrunk table must hold them.
+    if (!ht->capped &&
+            ((ht->t.count + ht->t.deleted + ht->old.count + 1) > ht->t.realsize * HLOADFACTOR)) {
+        logsize = ht->logsize;
+        if (ht->t.count + ht->old.count >= ht->t.realsize / 2) {
+            logsize++;
+        }
+        if (!_hresize(ht, logsize)) {
+            ht->capped = 1;
+        }
+    }
+    // the slots could not be resized: the caller has to free items to stay
+    // below the load factor, and the deleted slots are dropped in place once
+    // they fill the room above it, when a resize is tried again, too.
+    if (ht->capped) {
+        if ((ht->t.count + 1) > ht->t.realsize * HLOADFACTOR) {
+            return HERROR;
+        }
+        if ((ht->t.count + ht->t.deleted + 1) > ht->t.realsize * (HLOADFACTOR + HDELETED_ROOM)) {
+            logsize = ht->logsize + ((ht->t.count >= ht->t.realsize / 2) ? 1 : 0);
+            if (!_hresize(ht, logsize)) {
+                _hdrop_deleted(&ht->t);
+            }
+        }
+    }
+
+    it = _htake(&ht->t, h);
+    if (!it) {
+        return HERROR;
+    }
+    it->key = key;
+    it->klen = klen;
+    it->hash = h;
+    it->val = val;
+    return HSUCCESS;
+}
+
+_hitem *hget(_htab *ht, char *key, int klen, uint64_t h)
+{
+    _hitem *it;
+
+    _hstep(ht);
+
+    it = _hlookup(&ht->t, h, key, klen);
+    if (!it && ht->rehashidx != -1) {
+        it = _hlookup(&ht->old, h, key, klen);
+    }
+    return it;
+}
+
+_hitem *hgetval(_htab *ht, uint64_t h, void *val)
+{
+    _hitem *it;
+
+    it = _hlookupval(&ht->t, h, val);
+    if (!it && ht->rehashidx != -1) {
+        it = _hlookupval(&ht->old, h, val);
+    }
+    return it;
+}
+
+static int _henumslots(_hslots *s, int (*enumfn)(_hitem *item, void *arg), void *arg)
+{
+    int i, rc;
+
+    for(i=0; i<s->realsize; i++) {
+        if (s->ctrl[i] >= 0) {
+            rc = enumfn(&s->slots[i], arg); // item may be freed.
+            if (rc)
+                return rc;
+        }
+    }
+    return 0;
+}
+
+// enums items. Deleted slots do not hold an item, so enum_free has no effect.
+void henum(_htab *ht, int (*enumfn)(_hitem *item, void *arg), void *arg, int enum_free)
+{
+    if (enum_free) {
+        ;   // suppress unused param. warning.
+    }
+
+    if (ht->rehashidx != -1) {
+        if (_henumslots(&ht->old, enumfn, arg)) {
+            return;
+        }
+    }
+    _henumslots(&ht->t, enumfn, arg);
+}
+
+int hcount(_htab *ht)
+{
+    return ht->t.count + ht->old.count;
+}
+
+void hfree(_htab *ht, _hitem *item)
+{
+    _hslots *s;
+    int idx;
+
+    if ((item >= ht->t.slots) && (item < ht->t.slots + ht->t.realsize)) {
+        s = &ht->t;
+    } else {
+        s = &ht->old;
+    }
+    idx = item - s->slots;
+    if (s->ctrl[idx] < 0) {
+        return; // already freed
+    }
+    item->key = NULL;
+    _hrelease(s, idx);
+}
+
+#ifdef LC_TEST
+static int count_item_enum(_hitem *item, void *arg)
+{
+    if (item) {
+        (*(int *)arg)++;
+    }
+    return 0;
+}
+
+void test_hashtab(void)
+{
+    int i, n, rehashed;
+    char key[32];
+    static char keys[20000][16]; // the table does not copy the keys
+    _htab *ht;
+    _hitem *it;
+
+    ht = htcreate(2);
+    assert(ht != NULL);
+
+    // grow many times, every item must be reachable in the middle of a rehash.
+    rehashed = 0;
+    for(i=0; i<20000; i++) {
+        n = sprintf(keys[i], "key%d", i);
+        assert(hset(ht, keys[i], n, hhash(keys[i], n), (void *)(long)(i+1)) == HSUCCESS);
+        assert(hset(ht, keys[i], n, hhash(keys[i], n), NULL) == HEXISTS);
+        if (ht->rehashidx != -1) {
+            rehashed = 1;
+            n = sprintf(key, "key%d", i/2);
+            it = hget(ht, key, n, hhash(key, n));
+            assert(it != NULL);
+            assert(it->val == (void *)(long)(i/2+1));
+        }
+    }
+    assert(rehashed);
+    assert(hcount(ht) == 20000);
+
+    // keys of the same length and tag must not be confused.
+    assert(hget(ht, "key20000", 8, hhash("key20000", 8)) == NULL);
+    assert(hget(ht, "key1", 3, hhash("key1", 3)) == NULL);
+
+    for(i=0; i<20000; i+=2) {
+        n = sprintf(key, "key%d", i);
+        it = hget(ht, key, n, hhash(key, n));
+        assert(it != NULL);
+        hfree(ht, it);
+        assert(hget(ht, key, n, hhash(key, n)) == NULL);
+    }
+    assert(hcount(ht) == 10000);
+
+    n = 0;
+    henum(ht, count_item_enum, &n, 1);
+    assert(n == 10000);
+
+    // deleted slots are reused, the table does not keep growing.
+    n = ht->logsize;
+    for(i=0; i<200000; i++) {
+        assert(hset(ht, "churn", 5, hhash("churn", 5), NULL) == HSUCCESS);
+        it = hget(ht, "churn", 5, hhash("churn", 5));
+        assert(it != NULL);
+        hfree(ht, it);
+    }
+    assert(ht->logsize <= n + 1);
+    for(i=1; i<20000; i+=2) {
+        n = sprintf(key, "key%d", i);
+        it = hget(ht, key, n, hhash(key, n));
+        assert(it != NULL);
+        assert(it->val == (void *)(long)(i+1));
+    }
+
+    // a mostly empty table shrinks.
+    n = ht->logsize;
+    for(i=201; i<20000; i+=2) {
+        it = hget(ht, keys[i], strlen(keys[i]), hhash(keys[i], strlen(keys[i])));
+        assert(it != NULL);
+        hfree(ht, it);
+    }
+    for(i=0; i<100000; i++) {
+        hget(ht, "key1", 4, hhash("key1", 4));
+    }
+    assert(ht->logsize < n);
+    assert(ht->rehashidx == -1);
+    assert(hcount(ht) == 100);
+    for(i=1; i<200; i+=2) {
+        n = sprintf(key, "key%d", i);
+        it = hget(ht, key, n, hhash(key, n));
+        assert(it != NULL);
+        assert(it->val == (void *)(long)(i+1));
+    }
+
+    // equal hashes do not make equal keys.
+    assert(hset(ht, "coll1", 5, 42, (void *)1) == HSUCCESS);
+    assert(hset(ht, "coll2", 5, 42, (void *)2) == HSUCCESS);
+    assert(hget(ht, "coll1", 5, 42)->val == (void *)1);
+    assert(hget(ht, "coll2", 5, 42)->val == (void *)2);
+    assert(hgetval(ht, 42, (void *)2) == hget(ht, "coll2", 5, 42));
+    assert(hgetval(ht, 42, (void *)3) == NULL);
+    assert(hgetval(ht, 43, (void *)2) == NULL);
+
+    htdestroy(ht);
+
+    // deleted slots are dropped in place when the slots cannot be resized.
+    ht = htcreate(8);
+    assert(ht != NULL);
+    for(i=0; i<200; i++) {
+        n = strlen(keys[i]);
+        assert(hset(ht, keys[i], n, hhash(keys[i], n), (void *)(long)(i+1)) == HSUCCESS);
+    }
+    while(ht->rehashidx != -1) {
+        _hrehash_step(ht);
+    }
+    for(i=0; i<200; i+=3) {
+        n = strlen(keys[i]);
+        hfree(ht, _hlookup(&ht->t, hhash(keys[i], n), keys[i], n));
+    }
+    _hdrop_deleted(&ht->t);
+    assert(ht->t.deleted == 0);
+    assert(hcount(ht) == 133);
+    for(i=0; i<200; i++) {
+        n = strlen(keys[i]);
+        it = _hlookup(&ht->t, hhash(keys[i], n), keys[i], n);
+        if (i % 3) {
+            assert(it != NULL);
+            assert(it->val == (void *)(long)(i+1));
+        } else {
+            assert(it == NULL);
+        }
+    }
+    htdestroy(ht);
+}
+#endif
@@ -0,0 +1,638 @@
+#include "linux/io_uring.h"
+#include "sys/syscall.h"
+#include "sys/mman.h"
+#include "poll.h"
+#include "util.h"
+
+/* The handlers see the same interface as with epoll, but the socket I/O of
+ * the reads is done by io_uring:
+ *  - a listening socket has a multishot accept, every completion carries an
+ *    accepted fd that event_accept() hands out,
+ *  - a connection has a recv that takes a buffer from a ring of provided
+ *    buffers, event_read() copies the received bytes from there,
+ *  - writes are done by the handlers, a one-shot poll waits for a socket
+ *    that cannot take more.
+ * Requests are queued as SQEs and submitted together with the wait for
+ * completions in a single io_uring_enter() call per loop iteration.
+ * Connections with received bytes left unread are handled again in the next
+ * iteration, which keeps the level-triggered semantics of epoll. */
+
+#define URING_ENTRIES 4096
+#define URING_BUFS 256 /* provided buffers per worker, a power of two */
+#define URING_BUF_SIZE LIGHTCACHE_READ_BUFFER_SIZE
+#define URING_BGID 0
+#define URING_EOF 1 /* eof of a slot: the peer closed, or a -errno */
+
+/* requests of a slot, a bit for each in the armed flags of the slot. */
+#define URING_OP_POLL 1
+#define URING_OP_RECV 2
+#define URING_OP_ACCEPT 3
+
+/* user_data carries the fd, the generation of its slot and the request,
+ * never the conn pointer: a completion can arrive after the conn record was
+ * recycled or freed. The generation of a slot is bumped when the fd is
+ * deleted, so completions of an earlier connection on a reused fd are told
+ * apart. */
+#define URING_OP_MASK 0x03
+#define URING_GEN_MASK 0x3FFFFFFF /* the generation wraps at this width */
+#define URING_GEN_SHIFT 2
+#define URING_FD_SHIFT 32
+#define URING_DATA(fd, gen, op) (((uint64_t)(unsigned int)(fd) << URING_FD_SHIFT) | \
+                                 ((uint64_t)((gen) & URING_GEN_MASK) << URING_GEN_SHIFT) | (uint64_t)(op))
+#define URING_FD(data) ((int)((data) >> URING_FD_SHIFT))
+#define URING_GEN(data) ((unsigned int)((data) >> URING_GEN_SHIFT) & URING_GEN_MASK)
+#define URING_OP(data) ((int)((data) & URING_OP_MASK))
+
+typedef struct uring_fd {
+    conn *c;            /* NULL if the fd is not registered */
+    unsigned int gen;
+    int flags;          /* event flags set by event_set() */
+    int armed;          /* requests in flight, (1 << URING_OP_*) */
+    int eof;            /* no more bytes: URING_EOF or a -errno */
+    int ready;          /* in the ready list */
+    int nobufs;         /* in the list of fds waiting for a provided buffer */
+    int next_nobufs;    /* next fd in that list, -1 if none */
+    int head, tail;     /* received buffers not read yet, -1 if none */
+    unsigned int off;   /* bytes of the head buffer already read */
+} uring_fd;
+
+/* globals */
+static LC_THREAD int ringfd = -1;
+static LC_THREAD void (*event_handler)(conn *c, event ev) = NULL;
+
+static LC_THREAD unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static LC_THREAD unsigned int *cq_head, *cq_tail, *cq_mask;
+static LC_THREAD struct io_uring_sqe *sqes;
+static LC_THREAD struct io_uring_cqe *cqes;
+static LC_THREAD unsigned int sq_pending = 0; /* queued but not yet submitted SQEs */
+
+static LC_THREAD uring_fd *polls = NULL; /* indexed by fd */
+static LC_THREAD int npolls = 0;
+
+/* fds to be handled in the next iteration: bytes are waiting to be read, or
+ * a recv is to be armed again. */
+static LC_THREAD int *ready = NULL;
+static LC_THREAD int *ready_work = NULL;
+static LC_THREAD int nready = 0;
+
+/* fds whose recv failed with no provided buffer left. They are not armed
+ * again until a buffer is given back, one fd per buffer in FIFO order, so
+ * connections holding all the buffers do not make the others spin. */
+static LC_THREAD int nobufs_head = -1;
+static LC_THREAD int nobufs_tail = -1;
+
+static LC_THREAD struct io_uring_buf *buf_ring; /* shared with the kernel */
+static LC_THREAD unsigned short buf_tail;
+static LC_THREAD char *buf_mem;
+static LC_THREAD unsigned int buf_len[URING_BUFS]; /* received bytes */
+static LC_THREAD unsigned int buf_avail = 0; /* buffers in the ring */
+static LC_THREAD int buf_next[URING_BUFS]; /* next received buffer of the fd */
+
+static LC_THREAD int accepted = -1; /* fd of the accept being handled */
+
+/* functions */
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                       void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_submit(void)
+{
+    int ret;
+
+    while (sq_pending) {
+        ret = uring_enter(sq_pending, 0, 0, NULL, 0);
+        if (ret == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            LC_DEBUG(("io_uring_enter submit error.[%s]\r\n", strerror(errno)));
+            syslog(LOG_ERR, "%s (%s)", "io_uring_enter submit error.", strerror(errno));
+            return 0;
+        }
+        sq_pending -= ret;
+    }
+    return 1;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+    unsigned int tail;
+    struct io_uring_sqe *sqe;
+
+    tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == URING_ENTRIES) {
+        if (!uring_submit()) {
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[tail & *sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    sq_pending++;
+
+    return sqe;
+}
+
+static uring_fd *poll_slot(int fd)
+{
+    int n, i;
+    uring_fd *p;
+    int *r, *w;
+
+    if (fd >= npolls) {
+        n = npolls ? npolls : 1024;
+        while (n <= fd) {
+            n *= 2;
+        }
+        p = realloc(polls, n * sizeof(uring_fd));
+        if (!p) {
+            syslog(LOG_ERR, "io_uring poll table cannot be grown.[%d]", n);
+            return NULL;
+        }
+        polls = p;
+        r = realloc(ready, n * sizeof(int));
+        if (r) {
+            ready = r;
+        }
+        w = realloc(ready_work, n * sizeof(int));
+        if (w) {
+            ready_work = w;
+        }
+        if (!r || !w) {
+            syslog(LOG_ERR, "io_uring ready list cannot be grown.[%d]", n);
+            return NULL;
+        }
+        memset(&p[npolls], 0, (n - npolls) * sizeof(uring_fd));
+        for (i=npolls; i<n; i++) {
+            p[i].head = p[i].tail = -1;
+        }
+        npolls = n;
+    }
+    return &polls[fd];
+}
+
+static void mark_ready(int fd)
+{
+    if (!polls[fd].ready) {
+        polls[fd].ready = 1;
+        ready[nready++] = fd;
+    }
+}
+
+static void wait_buf(int fd)
+{
+    uring_fd *s;
+
+    s = &polls[fd];
+    if (s->nobufs) {
+        return;
+    }
+    s->nobufs = 1;
+    s->next_nobufs = -1;
+    if (nobufs_tail == -1) {
+        nobufs_head = fd;
+    } else {
+        polls[nobufs_tail].next_nobufs = fd;
+    }
+    nobufs_tail = fd;
+}
+
+// a buffer goes back to the ring once its bytes are read, and the first fd
+// still registered that waits for one is armed again.
+static void put_buf(int bid)
+{
+    int fd;
+    struct io_uring_buf *b;
+
+    b = &buf_ring[buf_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)&buf_mem[(size_t)bid * URING_BUF_SIZE];
+    b->len = URING_BUF_SIZE;
+    b->bid = (unsigned short)bid;
+    buf_tail++;
+    buf_avail++;
+    // the tail overlays the reserved field of the first buffer.
+    __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+
+    while (nobufs_head != -1) {
+        fd = nobufs_head;
+        nobufs_head = polls[fd].next_nobufs;
+        if (nobufs_head == -1) {
+            nobufs_tail = -1;
+        }
+        polls[fd].nobufs = 0;
+        if (polls[fd].c) {
+            mark_ready(fd);
+            break;
+        }
+    }
+}
+
+static int add_request(int fd, int op)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe();
+    if (!sqe) {
+        return 0;
+    }
+    sqe->fd = fd;
+    switch (op) {
+    case URING_OP_POLL:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLOUT;
+        break;
+    case URING_OP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->len = URING_BUF_SIZE;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        break;
+    case URING_OP_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        break;
+    }
+    sqe->user_data = URING_DATA(fd, polls[fd].gen, op);
+    polls[fd].armed |= 1 << op;
+    return 1;
+}
+
+static int cancel_request(int fd, int op)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe();
+    if (!sqe) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_DATA(fd, polls[fd].gen, op);
+    sqe->user_data = 0; // completion of the cancel itself is ignored.
+    return 1;
+}
+
+// queues the requests the interest of the fd needs and are not in flight.
+// A recv is armed only when the received bytes are read, so a connection
+// holds one provided buffer at most.
+static int arm(int fd)
+{
+    uring_fd *s;
+
+    s = &polls[fd];
+    if (!s->c) {
+        return 1;
+    }
+    if (s->flags & EVENT_READ) {
+        if (s->c->listening) {
+            if (!(s->armed & (1 << URING_OP_ACCEPT)) && !add_request(fd, URING_OP_ACCEPT)) {
+                return 0;
+            }
+        } else if (!(s->armed & (1 << URING_OP_RECV)) && (s->head == -1) && !s->eof &&
+                   !s->nobufs) {
+            if (!add_request(fd, URING_OP_RECV)) {
+                return 0;
+            }
+        }
+    }
+    if ((s->flags & EVENT_WRITE) && !(s->armed & (1 << URING_OP_POLL))) {
+        return add_request(fd, URING_OP_POLL);
+    }
+    return 1;
+}
+
+int event_init(void (*ev_handler)(conn *c, event ev), void (*tm_handler)(conn *c))
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    ringfd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ringfd == -1) {
+        LC_DEBUG(("io_uring_setup error.[%s]\r\n", strerror(errno)));
+        syslog(LOG_ERR, "%s (%s)", "io_uring setup error.", strerror(errno));
+        return 0;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) {
+            sq_size = cq_size;
+        }
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ringfd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringfd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            goto err;
+        }
+    }
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        goto err;
+    }
+
+    sq_head = (unsigned int *)(sq_ptr + p.sq_off.head);
+    sq_tail = (unsigned int *)(sq_ptr + p.sq_off.tail);
+    sq_mask = (unsigned int *)(sq_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned int *)(sq_ptr + p.sq_off.array);
+    cq_head = (unsigned int *)(cq_ptr + p.cq_off.head);
+    cq_tail = (unsigned int *)(cq_ptr + p.cq_off.tail);
+    cq_mask = (unsigned int *)(cq_ptr + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    // the ring of provided buffers the recvs take their buffer from.
+    buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf_mem = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (buf_ring == MAP_FAILED || !buf_mem) {
+        goto err;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        goto err;
+    }
+    buf_tail = 0;
+    buf_avail = 0;
+    for (i=0; i<URING_BUFS; i++) {
+        put_buf(i);
+    }
+
+    event_handler = ev_handler;
+    timer_init(tm_handler);
+    return ringfd;
+
+err:
+    LC_DEBUG(("io_uring init error.[%s]\r\n", strerror(errno)));
+    syslog(LOG_ERR, "%s (%s)", "io_uring init error.", strerror(errno));
+    close(ringfd);
+    return 0;
+}
+
+int event_del(conn *conn)
+{
+    int op, bid;
+    uring_fd *s;
+
+    s = poll_slot(conn->fd);
+    if (!s) {
+        return 0;
+    }
+    for (op=URING_OP_POLL; op<=URING_OP_ACCEPT; op++) {
+        if ((s->armed & (1 << op)) && !cancel_request(conn->fd, op)) {
+            return 0;
+        }
+    }
+    while (s->head != -1) {
+        bid = s->head;
+        s->head = buf_next[bid];
+        put_buf(bid);
+    }
+    s->c = NULL;
+    s->gen = (s->gen + 1) & URING_GEN_MASK;
+    s->flags = s->armed = s->eof = 0;
+    s->tail = -1;
+    s->off = 0;
+    return 1;
+}
+
+int event_set(conn *c, int flags)
+{
+    uring_fd *s;
+
+    s = poll_slot(c->fd);
+    if (!s) {
+        return 0;
+    }
+    s->c = c;
+    s->flags = flags;
+    // a poll that is not needed anymore is left to complete.
+    if ((flags & EVENT_READ) && ((s->head != -1) || s->eof)) {
+        mark_ready(c->fd);
+    }
+    return arm(c->fd);
+}
+
+int event_accept(conn *c)
+{
+    int fd;
+
+    (void)c;
+    fd = accepted;
+    if (fd == -1) {
+        errno = EAGAIN;
+    }
+    accepted = -1;
+    return fd;
+}
+
+ssize_t event_read(conn *c, void *buf, size_t count)
+{
+    int bid;
+    size_t n, len;
+    uring_fd *s;
+
+    if ((c->fd >= npolls) || (polls[c->fd].c != c)) {
+        return read(c->fd, buf, count);
+    }
+    s = &polls[c->fd];
+    n = 0;
+    while ((n < count) && (s->head != -1)) {
+        bid = s->head;
+        len = buf_len[bid] - s->off;
+        if (len > count - n) {
+            len = count - n;
+        }
+        memcpy((char *)buf + n, &buf_mem[(size_t)bid * URING_BUF_SIZE + s->off], len);
+        n += len;
+        s->off += len;
+        if (s->off == buf_len[bid]) {
+            s->head = buf_next[bid];
+            if (s->head == -1) {
+                s->tail = -1;
+            }
+            s->off = 0;
+            put_buf(bid);
+        }
+    }
+    if (n) {
+        return n;
+    }
+    if (s->eof == URING_EOF) {
+        return 0;
+    }
+    errno = s->eof ? -s->eof : EAGAIN;
+    return -1;
+}
+
+static void complete(int fd, int op, int res, unsigned int flags)
+{
+    uring_fd *s;
+
+    s = &polls[fd];
+    if (!(flags & IORING_CQE_F_MORE)) {
+        s->armed &= ~(1 << op);
+    }
+
+    switch (op) {
+    case URING_OP_ACCEPT:
+        if (res < 0) {
+            LC_DEBUG(("io_uring accept error.[%s]\r\n", strerror(-res)));
+            break;
+        }
+        accepted = res;
+        event_handler(s->c, EVENT_READ);
+        if (accepted != -1) {
+            close(accepted); // not taken by the handler.
+            accepted = -1;
+        }
+        break;
+    case URING_OP_RECV:
+        if (flags & IORING_CQE_F_BUFFER) {
+            buf_len[flags >> IORING_CQE_BUFFER_SHIFT] = res;
+            buf_next[flags >> IORING_CQE_BUFFER_SHIFT] = -1;
+            if (res <= 0) {
+                put_buf(flags >> IORING_CQE_BUFFER_SHIFT);
+            } else if (s->tail == -1) {
+                s->head = s->tail = flags >> IORING_CQE_BUFFER_SHIFT;
+            } else {
+                buf_next[s->tail] = flags >> IORING_CQE_BUFFER_SHIFT;
+                s->tail = flags >> IORING_CQE_BUFFER_SHIFT;
+            }
+        }
+        if (res == 0) {
+            s->eof = URING_EOF;
+        } else if ((res == -ENOBUFS) && !buf_avail) {
+            wait_buf(fd); // armed again by put_buf().
+            return;
+        } else if ((res < 0) && (res != -ENOBUFS)) {
+            s->eof = res;
+        }
+        // read by the handler, or armed again.
+        mark_ready(fd);
+        return;
+    case URING_OP_POLL:
+        if (s->flags & EVENT_WRITE) {
+            event_handler(s->c, EVENT_WRITE);
+        }
+        break;
+    }
+}
+
+static void handle_ready(void)
+{
+    int i, n, fd, *t;
+    uring_fd *s;
+
+    t = ready_work;
+    ready_work = ready;
+    ready = t;
+    n = nready;
+    nready = 0;
+    for (i=0; i<n; i++) {
+        fd = ready_work[i];
+        s = &polls[fd];
+        s->ready = 0;
+        if (!s->c) {
+            continue;
+        }
+        if ((s->flags & EVENT_READ) && ((s->head != -1) || s->eof)) {
+            event_handler(s->c, EVENT_READ);
+            s = &polls[fd];
+        }
+        if (s->c && (s->flags & EVENT_READ) && ((s->head != -1) || s->eof)) {
+            mark_ready(fd); // bytes left, as a level-triggered poll would report.
+        }
+        arm(fd);
+    }
+}
+
+void event_process(int timeout)
+{
+    int ret, fd;
+    unsigned int head, tail, flags;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    struct io_uring_cqe *cqe;
+    uint64_t data;
+
+    // no waiting while bytes are left to be read.
+    timeout = nready ? 0 : timer_timeout(timeout);
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    // submit the queued requests and wait in the same call.
+    ret = uring_enter(sq_pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+    update_time();
+    if (ret == -1) {
+        if (errno != ETIME && errno != EINTR) {
+            LC_DEBUG(("io_uring_enter error.[%s]\r\n", strerror(errno)));
+            syslog(LOG_ERR, "%s (%s)", "io_uring enter error.", strerror(errno));
+        }
+    } else {
+        sq_pending -= ret;
+    }
+
+    // process completions
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &cqes[head & *cq_mask];
+        data = cqe->user_data;
+        ret = cqe->res;
+        flags = cqe->flags;
+
+        // the slot can be re-used by the handler, so consume it first.
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (!data) {
+            continue; // cancels.
+        }
+        if (flags & IORING_CQE_F_BUFFER) {
+            buf_avail--;
+        }
+        fd = URING_FD(data);
+        if (fd >= npolls || polls[fd].gen != URING_GEN(data)) {
+            // stale, the fd was deleted. What it brought is given back.
+            if (flags & IORING_CQE_F_BUFFER) {
+                put_buf(flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if ((URING_OP(data) == URING_OP_ACCEPT) && (ret >= 0)) {
+                close(ret);
+            }
+            continue;
+        }
+        complete(fd, URING_OP(data), ret, flags);
+        if (polls[fd].gen == URING_GEN(data)) {
+            arm(fd);
+        }
+    }
+
+    handle_ready();
+
+    timer_process();
+}
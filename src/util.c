@@ -1,4 +1,6 @@
 
+#define _POSIX_C_SOURCE 200112L /* clock_gettime() */
+
 #include "util.h"
 #include "config.h"
 
@@ -143,6 +145,66 @@ int atoull(const char *s, uint64_t *ret)
     return 1;
 }
 
+/* seed for the key hashes, so that colliding keys cannot be crafted. */
+uint64_t random_seed(void)
+{
+    int fd;
+    uint64_t seed;
+
+    seed = 0;
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd != -1) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+            seed = 0;
+        }
+        close(fd);
+    }
+    if (!seed) {
+        seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^ (uint64_t)(uintptr_t)&seed;
+    }
+    return seed;
+}
+
+LC_THREAD uint64_t loop_time_ms = 0;
+
+/* msecs from an arbitrary point, it is only used to compare times. */
+uint64_t current_time_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return (uint64_t)time(NULL) * 1000;
+    }
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Samples the clock for CURRENT_TIME_MS of the calling thread. Workers call
+ * it once per event loop cycle, so requests and timers of a cycle see the
+ * same time. The coarse clock is only as precise as the scheduler tick, but
+ * it is read without touching the hardware counters. Loops bounded by time
+ * need the precise one and read current_time_ms() instead. */
+uint64_t update_time(void)
+{
+    struct timespec ts;
+    uint64_t now;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) != 0) {
+#else
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+#endif
+        now = (uint64_t)time(NULL) * 1000;
+    } else {
+        now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    }
+
+    // the time() fallback may go back, times are compared as unsigned.
+    if (now > loop_time_ms) {
+        loop_time_ms = now;
+    }
+    return loop_time_ms;
+}
+
 #ifdef LC_TEST
 /* See if compile time params are really set correctly */
 void test_endianness(void)
@@ -186,6 +248,14 @@ void test_util_routines(void)
     uch = u64_test.c[0];
     u64_test.i = 18446744073709551615U;    
     assert(uch == u64_test.c[0]); 
+
+    // the cached time is only changed by sampling.
+    assert(update_time() == CURRENT_TIME_MS);
+    assert(CURRENT_TIME_MS > 0);
+    u64_test.i = CURRENT_TIME_MS;
+    assert(current_time_ms() >= u64_test.i);
+    assert(CURRENT_TIME_MS == u64_test.i);
+    assert(update_time() >= u64_test.i);
 }
 
 
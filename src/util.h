@@ -11,12 +11,18 @@
 #endif
 
 #define CURRENT_TIME time(NULL)
+#define CURRENT_TIME_MS loop_time_ms /* msecs, sampled once per event loop cycle */
+
+extern LC_THREAD uint64_t loop_time_ms; /* see update_time() */
 
 void sig_handler(int signum);
 void deamonize(void);
 uint64_t ntohll(uint64_t val);
 uint64_t htonll(uint64_t val);
 int atoull(const char *s, uint64_t *ret);
+uint64_t random_seed(void);
+uint64_t current_time_ms(void);
+uint64_t update_time(void);
 
 
 #ifdef LC_TEST
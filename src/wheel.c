@@ -0,0 +1,234 @@
+#include "lightcache.h"
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS-1)
+#define WHEEL_SPAN(l) ((uint64_t)1 << (WHEEL_BITS*(l))) /* ticks covered by the slots of level l-1, a slot of level l */
+
+static void _wlink(wheel_node *head, wheel_node *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void _winit_head(wheel_node *head)
+{
+    head->prev = head->next = head;
+}
+
+void wheel_init(wheel *w, uint64_t now, unsigned int resolution)
+{
+    int l, i;
+
+    for (l=0; l<WHEEL_LEVELS; l++) {
+        for (i=0; i<WHEEL_SLOTS; i++) {
+            _winit_head(&w->slots[l][i]);
+        }
+    }
+    _winit_head(&w->due);
+    w->resolution = resolution;
+    w->tick = now / resolution;
+}
+
+// a node goes to the lowest level whose slots cover the ticks until it
+// expires. Nodes beyond the last level wait in its farthest slot and are
+// placed again when that slot is reached.
+static void _wplace(wheel *w, wheel_node *node)
+{
+    int l;
+    uint64_t t, delta;
+
+    t = node->expiry / w->resolution;
+    if (t < w->tick) {
+        _wlink(&w->due, node);
+        return;
+    }
+    delta = t - w->tick;
+    if (delta >= WHEEL_SPAN(WHEEL_LEVELS)) {
+        t = w->tick + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+        delta = WHEEL_SPAN(WHEEL_LEVELS) - 1;
+    }
+    for (l=0; l<WHEEL_LEVELS-1; l++) {
+        if (delta < WHEEL_SPAN(l+1)) {
+            break;
+        }
+    }
+    _wlink(&w->slots[l][(t >> (WHEEL_BITS*l)) & WHEEL_MASK], node);
+}
+
+static void _wcascade(wheel *w, wheel_node *head)
+{
+    wheel_node *node, *next;
+
+    node = head->next;
+    _winit_head(head);
+    while (node != head) {
+        next = node->next;
+        _wplace(w, node);
+        node = next;
+    }
+}
+
+void wheel_add(wheel *w, wheel_node *node, uint64_t expiry)
+{
+    node->expiry = expiry;
+    _wplace(w, node);
+}
+
+void wheel_del(wheel_node *node)
+{
+    if (!node->prev) {
+        return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+// node takes the place of old, it is a copy of old at another address.
+void wheel_replace(wheel_node *old, wheel_node *node)
+{
+    if (!node->prev) {
+        return;
+    }
+    node->prev->next = node;
+    node->next->prev = node;
+    old->prev = old->next = NULL;
+}
+
+// Moves the nodes of the passed ticks to the due list and hands out at most
+// budget of them to expirefn, removed from the wheel. The rest is handed out
+// by the next calls. Returns the number of nodes handed out.
+unsigned int wheel_expire(wheel *w, uint64_t now, unsigned int budget,
+                          void (*expirefn)(wheel_node *node, void *arg), void *arg)
+{
+    int l;
+    unsigned int n;
+    uint64_t now_tick;
+    wheel_node *node;
+
+    now_tick = now / w->resolution;
+    while (w->tick < now_tick) {
+        // upper slots reached by the tick are moved down first.
+        for (l=1; l<WHEEL_LEVELS; l++) {
+            if (w->tick & (WHEEL_SPAN(l) - 1)) {
+                break;
+            }
+            _wcascade(w, &w->slots[l][(w->tick >> (WHEEL_BITS*l)) & WHEEL_MASK]);
+        }
+        node = &w->slots[0][w->tick & WHEEL_MASK];
+        w->tick++;
+        _wcascade(w, node); // passed now, so due, unless waiting at the top
+    }
+
+    for (n=0; n<budget && w->due.next != &w->due; n++) {
+        node = w->due.next;
+        wheel_del(node);
+        expirefn(node, arg);
+    }
+    return n;
+}
+
+// Returns the msecs until wheel_expire() can hand out a node, at most limit.
+// Nodes of the upper levels are counted at the tick they are moved down, which
+// may be before they expire but never after.
+unsigned int wheel_next(wheel *w, uint64_t now, unsigned int limit)
+{
+    int l, i;
+    uint64_t t, end, at;
+    wheel_node *head;
+
+    if (w->due.next != &w->due) {
+        return 0;
+    }
+    end = (now + limit) / w->resolution;
+    for (l=0; l<WHEEL_LEVELS; l++) {
+        // ticks at which the slots of the level are reached, from the next one.
+        t = (w->tick + WHEEL_SPAN(l) - 1) & ~(WHEEL_SPAN(l) - 1);
+        for (i=0; i<WHEEL_SLOTS && t < end; i++, t += WHEEL_SPAN(l)) {
+            head = &w->slots[l][(t >> (WHEEL_BITS*l)) & WHEEL_MASK];
+            if (head->next != head) {
+                end = t;
+                break;
+            }
+        }
+    }
+    at = (end + 1) * w->resolution; // a tick is passed after its last msec
+    if (at <= now) {
+        return 0;
+    }
+    return (at - now < limit) ? (unsigned int)(at - now) : limit;
+}
+
+#ifdef LC_TEST
+static void count_expire(wheel_node *node, void *arg)
+{
+    assert(node->prev == NULL);
+    (*(int *)arg)++;
+}
+
+void test_wheel(void)
+{
+    int i, n;
+    wheel *w;
+    wheel_node nodes[1000];
+    wheel_node far, never, moved;
+
+    w = (wheel *)malloc(sizeof(wheel));
+    assert(w != NULL);
+    wheel_init(w, 100000, 10);
+
+    // a node every 7 msecs, on all levels.
+    for (i=0; i<1000; i++) {
+        nodes[i].prev = NULL;
+        wheel_add(w, &nodes[i], 100000 + i * i * 7);
+    }
+    wheel_add(w, &far, 100000 + WHEEL_SPAN(WHEEL_LEVELS) * 10 * 3);
+    never.prev = NULL;
+    wheel_del(&never); // not in the wheel
+
+    n = 0;
+    assert(wheel_expire(w, 100000, 1000, count_expire, &n) == 0);
+
+    // only expired ones, in budgets.
+    assert(wheel_expire(w, 100000 + 100 * 100 * 7 + 10, 30, count_expire, &n) == 30);
+    assert(wheel_expire(w, 100000 + 100 * 100 * 7 + 10, 1000, count_expire, &n) == 71);
+    assert(n == 101);
+
+    // removed ones are not expired, a moved one is in place of the old one.
+    for (i=101; i<200; i++) {
+        wheel_del(&nodes[i]);
+    }
+    moved = nodes[999];
+    wheel_replace(&nodes[999], &moved);
+    assert(nodes[999].prev == NULL);
+    wheel_expire(w, 100000 + 1000 * 1000 * 7 + 10, 1000, count_expire, &n);
+    assert(n == 101 + 800);
+    assert(moved.prev == NULL);
+
+    // waiting at the top is not expiring.
+    wheel_expire(w, 100000 + WHEEL_SPAN(WHEEL_LEVELS) * 10 * 2, 1000, count_expire, &n);
+    assert(n == 901);
+    assert(far.prev != NULL);
+    wheel_expire(w, 100000 + WHEEL_SPAN(WHEEL_LEVELS) * 10 * 3 + 10, 1000, count_expire, &n);
+    assert(n == 902);
+
+    // the next expiry, never later than the nodes expire.
+    wheel_init(w, 100000, 10);
+    assert(wheel_next(w, 100000, 1000) == 1000);
+    nodes[0].prev = nodes[1].prev = NULL;
+    wheel_add(w, &nodes[0], 100055);
+    wheel_add(w, &nodes[1], 105000);
+    assert(wheel_next(w, 100000, 1000) == 60);
+    assert(wheel_next(w, 100000, 50) == 50);
+    wheel_del(&nodes[0]);
+    assert(wheel_next(w, 100000, 1000) == 1000);
+    n = wheel_next(w, 100000, 10000);
+    assert(n > 0 && n <= 5000);
+    wheel_add(w, &nodes[0], 90000);
+    assert(wheel_next(w, 100000, 1000) == 0);
+
+    free(w);
+}
+#endif
@@ -0,0 +1,45 @@
+/*
+*    Hierarchical timing wheel
+*
+*    Nodes are embedded in the objects to be timed and are kept in slots by
+*    their expiry. Level 0 has a slot per tick, every upper level a slot per
+*    WHEEL_SLOTS ticks of the level below, whose nodes are moved down as the
+*    time approaches. Adding and removing a node is O(1) and expiring only
+*    visits the slots of the passed ticks.
+*/
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include "stdint.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* WHEEL_SLOTS^WHEEL_LEVELS ticks ahead, later ones wait at the top */
+
+typedef struct wheel_node {
+    struct wheel_node *prev; /* NULL if not in the wheel */
+    struct wheel_node *next;
+    uint64_t expiry; /* in msecs */
+} wheel_node;
+
+typedef struct wheel {
+    wheel_node slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* list heads */
+    wheel_node due; /* expired, not yet handed out */
+    uint64_t tick; /* next tick to be expired */
+    unsigned int resolution; /* msecs per tick */
+} wheel;
+
+void wheel_init(wheel *w, uint64_t now, unsigned int resolution);
+void wheel_add(wheel *w, wheel_node *node, uint64_t expiry);
+void wheel_del(wheel_node *node);
+void wheel_replace(wheel_node *old, wheel_node *node);
+unsigned int wheel_expire(wheel *w, uint64_t now, unsigned int budget,
+                          void (*expirefn)(wheel_node *node, void *arg), void *arg);
+unsigned int wheel_next(wheel *w, uint64_t now, unsigned int limit);
+
+#ifdef LC_TEST
+void test_wheel(void);
+#endif
+
+#endif
@@ -102,6 +102,14 @@ class LightCacheClient(socket.socket):
         self.send_packet(key=key, data=value, command=CMD_SET, extra=timeout)
         self.recv_packet()       
 
+    def set_ms(self, key, value, timeout_ms):
+        assert key is not None
+        assert value is not None
+        assert timeout_ms is not None
+        
+        self.send_packet(key=key, data=value, command=CMD_SET_MS, extra=struct.pack("!Q", timeout_ms))
+        self.recv_packet()
+
     def delete(self, key):
         assert key is not None
         
@@ -118,8 +126,11 @@ class LightCacheClient(socket.socket):
         self.send_packet(command=CMD_GET_STATS)
         return self.recv_packet()
         
-    def flush_all(self):
-        self.send_packet(command=CMD_FLUSH_ALL)
+    def flush_all(self, delay=None):
+        if delay is None:
+            self.send_packet(command=CMD_FLUSH_ALL)
+        else:
+            self.send_packet(command=CMD_FLUSH_ALL, extra=delay)
         self.recv_packet()
         
         
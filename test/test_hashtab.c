@@ -0,0 +1,21 @@
+#include "lightcache.h"
+#include "hashtab.h"
+#include "test_base.h"
+
+struct settings settings;
+
+int main(void)
+{
+    settings.use_sys_malloc = 1;
+    settings.mem_avail = 64 * 1024 * 1024;
+
+    TEST_START();
+    test_hhash();
+    TEST_END("test: hhash");
+
+    TEST_START();
+    test_hashtab();
+    TEST_END("test: hashtab");
+
+    return 0;
+}
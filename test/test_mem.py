@@ -1,3 +1,4 @@
+import time
 import unittest
 from testbase import LightCacheTestBase
 from protocolconf import *
@@ -27,22 +28,140 @@ class MemTests(LightCacheTestBase):
     #def test_memleak_test_itself_is_valid(self):
         # below command should create a hash entry on server side.
     #    self.assertRaises( AssertionError, self.check_for_memusage_delta, ([("set", "a_unique_long_key_to_be_malloced", "value1", 1),])  )
-    """
-    def test_out_of_memory(self):
-        self.client.flush_all()
-        i = 0        
-        while(True):
-            try:
-                self.client.set("key%d" % (i), "value(%d)" % (i), 100000)
-            except:
-                break           
-            i += 1 
-
-        # here we are sure that we encountered OOM condition. Problem is 
-        # on an OOM condition it is not possible to know whether to get a peer 
-        # disconnect or an OUT_OF_MEMORY error.
-        # TODO: Do something here after collect_unused_mem is implemented.
-    """
+
+    def test_evict_when_full(self):
+        self.client.flush_all()
+        value = "V" * 1000
+        stats = self._stats2dict(self.client.get_stats())
+        count = 2 * int(stats["mem_avail"]) / len(value)
+        for i in range(count):
+            self.client.set("evict%d" % (i), value, 100000)
+            self.assertErrorResponse(SUCCESS)
+        
+        # least recently used ones are evicted.
+        self.assertEqual(self.client.get("evict%d" % (count-1)), value)
+        self.assertKeyNotExists("evict0")
+        stats = self._stats2dict(self.client.get_stats())
+        self.assertTrue(int(stats["evictions"]) > 0)
+        self.client.flush_all()
+
+    def test_get_stats_when_full(self):
+        self.client.flush_all()
+        stats = self._stats2dict(self.client.get_stats())
+        if int(stats["mem_avail"]) > 64 * 1024 * 1024:
+            self.skipTest("takes too long to fill")
+        count = 2 * int(stats["mem_avail"]) / 600
+        for i in range(count):
+            self.client.set("full%d" % (i), "V" * (1 + i * 7919 % 1200), 100000)
+        
+        # the reply is not taken from the cache memory.
+        stats = self.client.get_stats()
+        self.assertErrorResponse(SUCCESS)
+        self.assertTrue(int(self._stats2dict(stats)["evictions"]) > 0)
+        self.client.flush_all()
+
+    def test_slabs_reassign(self):
+        self.client.flush_all()
+        value = "V" * 1000
+        stats = self._stats2dict(self.client.get_stats())
+        count = int(stats["mem_avail"]) / len(value) / 2 # not full, no class starves
+        for i in range(count):
+            self.client.set("reassign%d" % (i), value, 100000)
+            self.assertErrorResponse(SUCCESS)
+        moved = int(self._stats2dict(self.client.get_stats())["slabs_moved"])
+        
+        # a worker frees a slab of the class at its next audit.
+        self.client.chg_setting("slabs_reassign", len(value))
+        if self.client.response.errcode == INVALID_STATE:
+            self.skipTest("values are not allocated from slabs")
+        self.assertErrorResponse(SUCCESS)
+        for i in range(40):
+            stats = self._stats2dict(self.client.get_stats())
+            if int(stats["slabs_moved"]) > moved:
+                break
+            time.sleep(0.25)
+        self.assertTrue(int(stats["slabs_moved"]) > moved)
+        self.client.flush_all()
+
+    def _compacted_slabs(self, stats):
+        n = 0
+        for k, v in stats.items():
+            if k.startswith("class"):
+                n += int(dict(f.split("=") for f in v.split(","))["slabs_compacted"])
+        return n
+
+    def test_compact_sparse_slabs(self):
+        self.client.flush_all()
+        stats = self._settled_stats()
+        if not [k for k in stats if k.startswith("class")]:
+            self.skipTest("values are not allocated from slabs")
+        compacted = self._compacted_slabs(stats)
+        
+        # every fourth item stays, in many slabs of the class.
+        value = "V" * 1000
+        count = 8 * 1024 * 1024 / 1200
+        for i in range(count):
+            self.client.set("compact%d" % (i), value, 100000)
+            self.assertErrorResponse(SUCCESS)
+        for i in range(count):
+            if i % 4:
+                self.client.delete("compact%d" % (i))
+        
+        # the remaining ones are moved by the workers, still there.
+        for i in range(40):
+            stats = self._stats2dict(self.client.get_stats())
+            if self._compacted_slabs(stats) > compacted:
+                break
+            time.sleep(0.25)
+        self.assertTrue(self._compacted_slabs(stats) > compacted)
+        for i in range(0, count, 4):
+            self.assertEqual(self.client.get("compact%d" % (i)), value)
+        self.client.flush_all()
+
+    def _sizes(self, stats):
+        return dict((int(k[4:]), int(v)) for k, v in stats.items() if k[4:].isdigit())
+
+    def test_slab_layout(self):
+        stats = self._stats2dict(self.client.get_stats())
+        if "slab_layout" not in stats:
+            self.skipTest("values are not allocated from slabs")
+        sizes = self._sizes(stats)
+        
+        value = "V" * 700
+        for i in range(2000):
+            self.client.set("layout%05d" % (i), value, 100000)
+            self.assertErrorResponse(SUCCESS)
+        
+        # the size counted most gets a chunk size of its own.
+        stats = self._stats2dict(self.client.get_stats())
+        counted = self._sizes(stats)
+        size = max(counted, key=lambda s: counted[s] - sizes.get(s, 0))
+        self.assertTrue(counted[size] - sizes.get(size, 0) >= 2000)
+        self.assertTrue(str(size) in stats["slab_layout"].split(","))
+        self.assertTrue(int(stats["size_waste_layout"]) <= int(stats["size_waste"]))
+        for i in range(2000):
+            self.client.delete("layout%05d" % (i))
+
+    def test_admission_keeps_hot_keys(self):
+        stats = self._stats2dict(self.client.get_stats())
+        if stats["admission"] == "0":
+            self.skipTest("admission is disabled")
+        self.client.flush_all()
+        value = "V" * 1000
+        self.client.set("hot", value, 100000)
+        for i in range(5):
+            self.assertEqual(self.client.get("hot"), value)
+        
+        # a scan of keys read once cannot evict a key read often.
+        count = 2 * int(stats["mem_avail"]) / len(value)
+        for i in range(count):
+            self.client.set("scan%d" % (i), value, 100000)
+            self.assertErrorResponse(SUCCESS)
+        self.assertEqual(self.client.get("hot"), value)
+        stats = self._stats2dict(self.client.get_stats())
+        self.assertTrue(int(stats["rejected"]) > 0)
+        self.client.flush_all()
+        
 if __name__ == '__main__':
     print "Running MemTests..."
     unittest.main()
@@ -1,6 +1,6 @@
 import time
 import unittest
-from testbase import LightCacheTestBase
+from testbase import LightCacheTestBase, make_client
 from protocolconf import *
 
 class ProtocolTests(LightCacheTestBase):
@@ -21,6 +21,26 @@ class ProtocolTests(LightCacheTestBase):
         self.client.chg_setting("idle_conn_timeout", 2)
         self.assertDisconnected(in_secs=10)
     
+    def test_idle_timeout_on_time(self):
+        timeout = self.client.get_setting("idle_conn_timeout")
+        self.client.chg_setting("idle_conn_timeout", 100)
+        other = make_client()
+        other.set("idlekey", "value", 100)
+        for i in range(5): # the buffers of the other one are released
+            time.sleep(0.5)
+            self.client.get_setting("idle_conn_timeout")
+        self.client.chg_setting("idle_conn_timeout", 1)
+        start = time.time()
+        self.assertDisconnected(in_secs=5)
+        self.assertTrue(time.time() - start < 1.5)
+        
+        # connections idle for longer are dropped at the next audit.
+        self.assertTrue(other.is_disconnected(5))
+        self.assertTrue(time.time() - start < 4)
+        client = make_client()
+        client.chg_setting("idle_conn_timeout", timeout)
+        client.close()
+    
     def test_send_overflow_header(self):
         self.client.send_raw("OVERFLOWHEADER")
         self.client.recv_packet()
@@ -39,6 +59,77 @@ class ProtocolTests(LightCacheTestBase):
     def test_get_stats(self):
         stats = self._stats2dict(self.client.get_stats())
         self.assertTrue(stats.has_key("mem_used"))
+
+    def test_get_stats_shards(self):
+        self.client.set("shardkey1", "value1", 11)
+        stats = self._stats2dict(self.client.get_stats())
+        items = 0
+        for i in range(int(stats["shards"])):
+            shard = dict(s.split("=") for s in stats["shard%d" % i].split(","))
+            items += int(shard["items"])
+        self.assertEqual(items, int(stats["curr_items"]))
+
+    def test_idle_conn_buffers_released(self):
+        timeout = self.client.get_setting("idle_conn_timeout")
+        self.client.chg_setting("idle_conn_timeout", 100)
+        clients = [make_client() for i in range(20)]
+        for i, c in enumerate(clients):
+            c.set("idlekey%d" % (i), "value", 100)
+        stats = self._stats2dict(self.client.get_stats())
+        self.assertTrue(int(stats["conn_buffers"]) >= 21)
+        memory = int(stats["conn_memory"])
+        
+        # idle ones keep their conn record only, buffers come back with bytes.
+        for i in range(40):
+            time.sleep(0.25)
+            stats = self._stats2dict(self.client.get_stats())
+            if int(stats["conn_buffers"]) <= 1:
+                break
+        self.assertTrue(int(stats["conn_buffers"]) <= 1)
+        self.assertTrue(int(stats["conn_memory"]) < memory)
+        for i, c in enumerate(clients):
+            self.assertEqual(c.get("idlekey%d" % (i)), "value")
+            c.close()
+        self.client.chg_setting("idle_conn_timeout", timeout)
+
+    def test_closed_conns_reused(self):
+        clients = [make_client() for i in range(10)]
+        for c in clients:
+            c.set("reusekey", "value", 100)
+        peak = int(self._stats2dict(self.client.get_stats())["conn_memory"])
+        for c in clients:
+            c.close()
+        
+        # closed conn records are taken again by new connections.
+        for i in range(1000):
+            c = make_client()
+            c.set("reusekey", "value", 100)
+            c.close()
+        time.sleep(0.2)
+        after = int(self._stats2dict(self.client.get_stats())["conn_memory"])
+        self.assertTrue(after <= peak)
+        self.assertEqual(self.client.get("reusekey"), "value")
+
+    def test_get_stats_numa(self):
+        before = self._stats2dict(self.client.get_stats())
+        for i in range(100):
+            self.client.set("numakey%d" % (i), "value", 100)
+        stats = self._stats2dict(self.client.get_stats())
+        shards = [dict(s.split("=") for s in stats["shard%d" % i].split(","))
+            for i in range(int(stats["shards"]))]
+        if not [s for s in shards if s["mem_used"] != "0" and s["node"] != "-1"]:
+            self.skipTest("shards have no arenas of their own")
+        
+        # items are counted by the node of the shard arena they are set to.
+        nodes = set(int(s["node"]) for s in shards)
+        self.assertTrue(min(nodes) >= 0 and max(nodes) < int(stats["numa_nodes"]))
+        local = int(stats["alloc_local"]) - int(before["alloc_local"])
+        remote = int(stats["alloc_remote"]) - int(before["alloc_remote"])
+        self.assertEqual(local + remote, 100)
+        if len(nodes) == 1:
+            self.assertEqual(remote, 0)
+        else:
+            self.assertTrue(local > 0 and remote > 0)
     
     def test_get(self):
         self.client.set("key2", "value2", 13)
@@ -76,6 +167,16 @@ class ProtocolTests(LightCacheTestBase):
         self.client.chg_setting("idle_conn_timeout", "invalid_value")
         self.assertErrorResponse(INVALID_PARAM)
 
+    def test_chg_setting_slab_automove(self):
+        self.client.chg_setting("slab_automove", 0)
+        self.assertEqual(self.client.get_setting("slab_automove"), 0)
+        self.client.chg_setting("slab_automove", 1)
+        self.assertEqual(self.client.get_setting("slab_automove"), 1)
+
+    def test_chg_setting_slabs_reassign_invalid(self):
+        self.client.chg_setting("slabs_reassign", 1024 * 1024)
+        self.assertErrorResponse(INVALID_PARAM)
+
     def test_chg_setting_overflowed(self):
         self.client.chg_setting("idle_conn_timeout", 2222222222222222222222222222222)
         self.assertErrorResponse(INVALID_PARAM)
@@ -91,12 +192,43 @@ class ProtocolTests(LightCacheTestBase):
         self.assertEqual(self.client.recv_packet(), "val_sub")
         self.assertEqual(self.client.recv_packet(), "val_sub")
 
+    def test_pipelined_packets(self):
+        self.client.set("key_pipe", "val_pipe", 60)
+        packet = self.client._make_packet(key="key_pipe", command=CMD_GET)
+        self.client.send_raw(packet * 5)
+        for i in range(5):
+            self.assertEqual(self.client.recv_packet(), "val_pipe")
+
     def test_get_with_timeout(self):
         self.client.set("key2", "value3", 2)
         time.sleep(1)
         self.assertEqual(self.client.get("key2"), "value3")
         time.sleep(2)
         self.assertKeyNotExists("key2")
+
+    def test_get_with_timeout_ms(self):
+        self.client.set_ms("key_ms", "value_ms", 300)
+        self.assertEqual(self.client.get("key_ms"), "value_ms")
+        time.sleep(0.5)
+        self.assertKeyNotExists("key_ms")
+
+    def test_set_ms_invalid_timeout(self):
+        self.client.set_ms("key_ms", "value_ms", 0)
+        self.assertErrorResponse(INVALID_PARAM)
+        self.client.send_packet(key="key_ms", data="value_ms", command=CMD_SET_MS, extra="300")
+        self.client.recv_packet()
+        self.assertErrorResponse(INVALID_PARAM)
+
+    def test_expired_items_reclaimed(self):
+        stats = self._stats2dict(self.client.get_stats())
+        self.client.set_ms("key_reclaim", "value_reclaim", 100)
+        for i in range(20): # until the next audit of the worker, without a GET
+            time.sleep(0.25)
+            cstats = self._stats2dict(self.client.get_stats())
+            if int(cstats["expired_unfetched"]) > int(stats["expired_unfetched"]):
+                break # flushed items may be reclaimed meanwhile, too
+        self.assertTrue(int(cstats["reclaimed"]) > int(stats["reclaimed"]))
+        self.assertTrue(int(cstats["expired_unfetched"]) > int(stats["expired_unfetched"]))
         
     def test_delete(self):
         self.client.set("key5", "value5", 2)
@@ -119,6 +251,32 @@ class ProtocolTests(LightCacheTestBase):
         self.assertKeyNotExists("k1")
         self.assertKeyNotExists("k2")
         self.assertKeyNotExists("k3")
+
+    def test_flush_all_delayed(self):
+        self.client.set("k1", "v1")
+        self.client.flush_all(1)
+        self.assertErrorResponse(SUCCESS)
+        self.assertEqual(self.client.get("k1"), "v1")
+        time.sleep(1.2)
+        self.assertKeyNotExists("k1")
+
+    def test_flush_all_reclaimed(self):
+        self.client.set("k1", "v1")
+        self.client.set("k2", "v2")
+        self.client.flush_all()
+        stats = self._stats2dict(self.client.get_stats())
+        self.assertTrue(int(stats["stale_items"]) >= 2)
+        self.client.set("k2", "v2_new") # set after the flush, not stale
+        self.assertEqual(self.client.get("k2"), "v2_new")
+        for i in range(20): # until the next audit of the worker
+            time.sleep(0.25)
+            stats = self._stats2dict(self.client.get_stats())
+            if stats["stale_items"] == "0":
+                break
+        self.assertEqual(stats["stale_items"], "0")
+        self.assertEqual(self.client.get("k2"), "v2_new")
+        self.client.flush_all("invalid")
+        self.assertErrorResponse(INVALID_PARAM)
         
 if __name__ == '__main__':
     print "Running ProtocolTests..."
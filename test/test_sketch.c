@@ -0,0 +1,17 @@
+#include "lightcache.h"
+#include "sketch.h"
+#include "test_base.h"
+
+struct settings settings;
+
+int main(void)
+{
+    settings.use_sys_malloc = 1;
+    settings.mem_avail = 64 * 1024 * 1024;
+
+    TEST_START();
+    test_sketch();
+    TEST_END("test: sketch");
+
+    return 0;
+}
@@ -16,5 +16,21 @@ int main(void)
     test_size_to_cache();
     TEST_END("test: size_to_cache");
 
+    TEST_START();
+    test_arenas();
+    TEST_END("test: arenas");
+
+    TEST_START();
+    test_drain();
+    TEST_END("test: drain");
+
+    TEST_START();
+    test_layout();
+    TEST_END("test: layout");
+
+    TEST_START();
+    test_commit();
+    TEST_END("test: commit");
+
     return 0;
 }
@@ -0,0 +1,12 @@
+#include "lightcache.h"
+#include "wheel.h"
+#include "test_base.h"
+
+int main(void)
+{
+    TEST_START();
+    test_wheel();
+    TEST_END("test: wheel");
+
+    return 0;
+}
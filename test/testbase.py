@@ -1,3 +1,4 @@
+import time
 import unittest
 import socket
 import testconf
@@ -41,12 +42,24 @@ class LightCacheTestBase(unittest.TestCase):
             result[stat[0]] = stat[1]	    
         return result
 
+    def _settled_stats(self):
+        # connections of the previous tests may still be closing on other
+        # worker threads and flushed items are reclaimed by the audits, both
+        # freeing memory.
+        stats = self._stats2dict(self.client.get_stats())
+        for i in range(200):
+            time.sleep(0.05)
+            prev, stats = stats, self._stats2dict(self.client.get_stats())
+            if prev["mem_used"] == stats["mem_used"] and stats["stale_items"] == "0":
+                break
+        return stats
+
     def check_for_memusage_delta(self, cmd_list, delta=0):
         """
         executes the commands and checks for the mem usage delta
         via GET_STATS command before/after execution.
         """
-        pstats = self._stats2dict(self.client.get_stats())
+        pstats = self._settled_stats()
         for cmd_tpl in cmd_list:	    
             cmd = getattr(self.client, cmd_tpl[0])
             cmd_args = cmd_tpl[1:]
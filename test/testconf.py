@@ -3,6 +3,9 @@ host = 'localhost'
 port = 13131 
 mem_avail = 1
 fd_limit = 2048
+num_threads = 1
+num_shards = 1
+admission = False
 
 #use_unix_socket = True
 use_unix_socket = False